@@ -0,0 +1,194 @@
+/*
+ * Order statistics over cycle/tick samples collected by benchmarks.
+ */
+#include <libcflat.h>
+#include "stats.h"
+
+static void sift_down(u64 *a, int root, int end)
+{
+	u64 tmp;
+	int child;
+
+	while ((child = 2 * root + 1) < end) {
+		if (child + 1 < end && a[child] < a[child + 1])
+			child++;
+		if (a[root] >= a[child])
+			return;
+		tmp = a[root];
+		a[root] = a[child];
+		a[child] = tmp;
+		root = child;
+	}
+}
+
+void stats_sort(u64 *samples, int n)
+{
+	u64 tmp;
+	int i;
+
+	for (i = n / 2 - 1; i >= 0; i--)
+		sift_down(samples, i, n);
+
+	for (i = n - 1; i > 0; i--) {
+		tmp = samples[0];
+		samples[0] = samples[i];
+		samples[i] = tmp;
+		sift_down(samples, 0, i);
+	}
+}
+
+u64 stats_percentile(const u64 *sorted, int n, int pct)
+{
+	int idx;
+
+	if (n <= 0)
+		return 0;
+
+	/* nearest-rank: smallest value with at least pct% of samples <= it */
+	idx = (pct * n + 99) / 100 - 1;
+	if (idx < 0)
+		idx = 0;
+	if (idx >= n)
+		idx = n - 1;
+	return sorted[idx];
+}
+
+u64 stats_isqrt(u64 x)
+{
+	u64 r = 0, bit = 1ull << 62;
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
+
+void stats_moments(const u64 *samples, int n, u64 *mean, u64 *stddev)
+{
+	u64 sum = 0, sq = 0, d;
+	int i;
+
+	*mean = *stddev = 0;
+	if (n <= 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+	*mean = sum / n;
+	if (n < 2)
+		return;
+
+	/* squared deviations saturate rather than wrap on wild outliers */
+	for (i = 0; i < n; i++) {
+		d = samples[i] > *mean ? samples[i] - *mean : *mean - samples[i];
+		d = d < (1ull << 32) ? d * d : ~0ull;
+		sq = sq + d < sq ? ~0ull : sq + d;
+	}
+	*stddev = stats_isqrt(sq / (n - 1));
+}
+
+u64 stats_ci_permille(const u64 *samples, int n)
+{
+	u64 mean, stddev;
+
+	if (n < 2)
+		return ~0ull;
+	stats_moments(samples, n, &mean, &stddev);
+	if (!mean)
+		return stddev ? ~0ull : 0;
+
+	/* 1.96 * stddev / sqrt(n), relative to the mean */
+	return 1960 * stddev / (stats_isqrt(n) * mean);
+}
+
+void stats_compute(u64 *samples, int n, struct stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	if (n <= 0)
+		return;
+
+	stats_moments(samples, n, &st->mean, &st->stddev);
+	stats_sort(samples, n);
+
+	st->n = n;
+	st->min = samples[0];
+	st->median = stats_percentile(samples, n, 50);
+	st->p90 = stats_percentile(samples, n, 90);
+	st->p99 = stats_percentile(samples, n, 99);
+	st->max = samples[n - 1];
+}
+
+void stats_print(const char *name, const struct stats *st)
+{
+	printf("%s n=%d min=%" PRIu64 " median=%" PRIu64 " p90=%" PRIu64
+	       " p99=%" PRIu64 " max=%" PRIu64 " mean=%" PRIu64
+	       " stddev=%" PRIu64 "\n",
+	       name, st->n, st->min, st->median, st->p90, st->p99,
+	       st->max, st->mean, st->stddev);
+}
+
+void stats_report(u64 *samples, int n, struct stats *st,
+		  const char *name_fmt, ...)
+{
+	struct stats local;
+	char name[64];
+	va_list va;
+
+	if (!st)
+		st = &local;
+	va_start(va, name_fmt);
+	vsnprintf(name, sizeof(name), name_fmt, va);
+	va_end(va);
+
+	stats_compute(samples, n, st);
+	stats_print(name, st);
+}
+
+bool stats_sample(bool (*fn)(int i, u64 *out, void *data), void *data,
+		  int warmup, u64 *samples, int n)
+{
+	u64 discard;
+	int i;
+
+	for (i = 0; i < warmup; i++)
+		if (!fn(-1, &discard, data))
+			return false;
+	for (i = 0; i < n; i++)
+		if (!fn(i, &samples[i], data))
+			return false;
+	return true;
+}
+
+void stats_hist_add(struct stats_hist *h, u64 value)
+{
+	int i = value ? 64 - __builtin_clzll(value) : 0;
+
+	h->bucket[MIN(i, STATS_HIST_BUCKETS - 1)]++;
+}
+
+void stats_hist_print(const char *name, const struct stats_hist *h)
+{
+	u64 lo, hi;
+	int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		lo = i ? 1ull << (i - 1) : 0;
+		hi = i ? 1ull << i : 1;
+		if (i == STATS_HIST_BUCKETS - 1)
+			printf("%s [%" PRIu64 ", inf) %" PRIu64 "\n",
+			       name, lo, h->bucket[i]);
+		else
+			printf("%s [%" PRIu64 ", %" PRIu64 ") %" PRIu64 "\n",
+			       name, lo, hi, h->bucket[i]);
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+/*
+ * Order statistics over cycle/tick samples collected by benchmarks.
+ *
+ * Tests record raw per-iteration costs into a caller-owned u64 array
+ * and hand it to stats_compute(), which sorts the array in place.
+ * Everything is integer arithmetic; x86-64 tests are built without SSE.
+ */
+#include <libcflat.h>
+
+struct stats {
+	int n;
+	u64 min;
+	u64 median;
+	u64 p90;
+	u64 p99;
+	u64 max;
+	u64 mean;
+	u64 stddev;		/* sample standard deviation, rounded down */
+};
+
+/* In-place ascending heapsort, no recursion and no extra memory */
+extern void stats_sort(u64 *samples, int n);
+
+/* @pct-th percentile (0..100) of an already sorted array */
+extern u64 stats_percentile(const u64 *sorted, int n, int pct);
+
+/* Sort @samples and fill @st; @n may be 0, in which case @st is zeroed */
+extern void stats_compute(u64 *samples, int n, struct stats *st);
+
+/* Mean and sample standard deviation of unsorted @samples */
+extern void stats_moments(const u64 *samples, int n, u64 *mean, u64 *stddev);
+
+/*
+ * Half-width of the 95% confidence interval of the mean, in permille of
+ * the mean; ~0 while there are too few samples to tell. Benchmarks that
+ * stop once this is small enough run as long as noise requires and no
+ * longer.
+ */
+extern u64 stats_ci_permille(const u64 *samples, int n);
+
+/* floor(sqrt(@x)) */
+extern u64 stats_isqrt(u64 x);
+
+/*
+ * One line: "<name> n=.. min=.. median=.. p90=.. p99=.. max=.. mean=..
+ * stddev=.."
+ */
+extern void stats_print(const char *name, const struct stats *st);
+
+/* stats_compute() and stats_print() under a printf-style name; @st may be NULL */
+extern void stats_report(u64 *samples, int n, struct stats *st,
+			 const char *name_fmt, ...)
+					__attribute__((format(printf, 4, 5)));
+
+/*
+ * The warm-up and sampling loop of a benchmark: @fn is called @warmup
+ * times with @i < 0 and its sample thrown away, then for @i = 0..n-1
+ * with @out pointing to @samples[i]. @fn returns false to give up, e.g.
+ * when an interrupt never arrived; so does stats_sample() then.
+ */
+extern bool stats_sample(bool (*fn)(int i, u64 *out, void *data), void *data,
+			 int warmup, u64 *samples, int n);
+
+/*
+ * Fixed-point values with two decimals, for ratios and percentages:
+ * printf("ratio " STATS_X100_FMT "\n", STATS_X100(stats_ratio_x100(a, b)));
+ */
+#define STATS_X100_FMT		"%" PRIu64 ".%02" PRIu64
+#define STATS_X100(v)		(u64)(v) / 100, (u64)(v) % 100
+
+static inline u64 stats_ratio_x100(u64 a, u64 b)
+{
+	return a * 100 / (b ? b : 1);
+}
+
+/*
+ * Power-of-two histogram: bucket 0 counts zeroes, bucket i counts values
+ * in [2^(i-1), 2^i). Cheap enough to update from an interrupt handler.
+ */
+#define STATS_HIST_BUCKETS	40
+
+struct stats_hist {
+	u64 bucket[STATS_HIST_BUCKETS];
+};
+
+extern void stats_hist_add(struct stats_hist *h, u64 value);
+
+/* One line per non-empty bucket: "<name> [lo, hi) count" */
+extern void stats_hist_print(const char *name, const struct stats_hist *h);
+
+#endif
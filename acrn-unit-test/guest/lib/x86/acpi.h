@@ -10,6 +10,7 @@
 #define RSDT_SIGNATURE ACPI_SIGNATURE('R','S','D','T')
 #define FACP_SIGNATURE ACPI_SIGNATURE('F','A','C','P')
 #define FACS_SIGNATURE ACPI_SIGNATURE('F','A','C','S')
+#define HPET_SIGNATURE ACPI_SIGNATURE('H','P','E','T')
 
 struct rsdp_descriptor {        /* Root System Descriptor Pointer */
     u64 signature;              /* ACPI signature, contains "RSD PTR " */
@@ -99,6 +100,20 @@ struct facs_descriptor_rev1
     u8  reserved3 [40];         /* Reserved - must be zero */
 };
 
+struct hpet_descriptor_rev1
+{
+    ACPI_TABLE_HEADER_DEF       /* ACPI common table header */
+    u32 event_timer_block_id;   /* Hardware ID of event timer block */
+    u8  space_id;               /* Base address: 0 system memory, 1 I/O */
+    u8  bit_width;              /* Base address register width */
+    u8  bit_offset;             /* Base address register offset */
+    u8  access_width;           /* Base address access size */
+    u64 address;                /* Base address of the HPET registers */
+    u8  hpet_number;            /* HPET sequence number */
+    u16 min_tick;               /* Minimum periodic clock tick */
+    u8  page_protection;        /* Page protection and OEM attribute */
+} __attribute__((packed));
+
 void* find_acpi_table_addr(u32 sig);
 
 #endif
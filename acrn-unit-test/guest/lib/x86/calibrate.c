@@ -0,0 +1,159 @@
+/*
+ * TSC and APIC timer frequency calibration, see calibrate.h.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "asm/io.h"
+#include "acpi.h"
+#include "hyperv.h"
+#include "calibrate.h"
+
+#define PM_TIMER_CALIB_TICKS		(PM_TIMER_HZ / 20)	/* 50ms */
+/* give up on a PM timer that does not move, ~1s on any sane TSC */
+#define PM_TIMER_TIMEOUT_TSC		(1ull << 32)
+
+struct timebase timebase;
+
+static const char *const calib_source_names[] = {
+	[CALIB_NONE]		= "none",
+	[CALIB_HV_MSR]		= "Hyper-V frequency MSRs",
+	[CALIB_CPUID_15]	= "CPUID 0x15",
+	[CALIB_PM_TIMER]	= "ACPI PM timer",
+	[CALIB_CPUID_16]	= "CPUID 0x16",
+};
+
+const char *calib_source_name(enum calib_source source)
+{
+	return calib_source_names[source];
+}
+
+static bool hv_frequency_msrs(u64 *tsc_hz, u64 *apic_hz)
+{
+	if (!(cpuid(1).c & (1u << 31)) || cpuid(0x40000000).a < HYPERV_CPUID_FEATURES)
+		return false;
+	if (!(cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_ACCESS_FREQUENCY_MSRS))
+		return false;
+
+	*tsc_hz = rdmsr(HV_X64_MSR_TSC_FREQUENCY);
+	*apic_hz = rdmsr(HV_X64_MSR_APIC_FREQUENCY);
+	return *tsc_hz != 0;
+}
+
+/*
+ * CPUID 0x15 gives the TSC/crystal ratio and, on most parts, the
+ * crystal frequency, which also clocks the APIC timer. Without the
+ * crystal frequency the TSC rate falls back to the 0x16 base frequency.
+ */
+static bool cpuid_frequency(u64 *tsc_hz, u64 *apic_hz, bool *exact)
+{
+	struct cpuid c15, c16;
+
+	*exact = false;
+	if (cpuid(0).a < 0x15)
+		return false;
+
+	c15 = cpuid_indexed(0x15, 0);
+	if (c15.a && c15.b && c15.c) {
+		*tsc_hz = (u64)c15.c * c15.b / c15.a;
+		*apic_hz = c15.c;
+		*exact = true;
+		return true;
+	}
+
+	if (cpuid(0).a < 0x16)
+		return false;
+	c16 = cpuid_indexed(0x16, 0);
+	if (!c16.a)
+		return false;
+	*tsc_hz = (u64)c16.a * 1000000;
+	*apic_hz = c15.a && c15.b ? *tsc_hz * c15.a / c15.b : 0;
+	return true;
+}
+
+static u32 pm_timer_read(u32 port)
+{
+	return inl(port) & PM_TIMER_MASK;
+}
+
+/* Count TSC ticks over PM_TIMER_CALIB_TICKS of the 3.579545MHz PM timer */
+static u64 pm_timer_tsc_hz(void)
+{
+	struct fadt_descriptor_rev1 *fadt;
+	u32 port, start, now, elapsed;
+	u64 tsc0, tsc1;
+
+	fadt = find_acpi_table_addr(FACP_SIGNATURE);
+	if (!fadt || !fadt->pm_tmr_blk)
+		return 0;
+	port = fadt->pm_tmr_blk;
+
+	/* start right after an edge */
+	start = pm_timer_read(port);
+	tsc0 = rdtsc();
+	while ((now = pm_timer_read(port)) == start)
+		if (rdtsc() - tsc0 > PM_TIMER_TIMEOUT_TSC)
+			return 0;
+	start = now;
+	tsc0 = rdtsc();
+
+	do {
+		now = pm_timer_read(port);
+		elapsed = (now - start) & PM_TIMER_MASK;
+		tsc1 = rdtsc();
+		if (tsc1 - tsc0 > 4 * PM_TIMER_TIMEOUT_TSC)
+			return 0;
+	} while (elapsed < PM_TIMER_CALIB_TICKS);
+
+	return (tsc1 - tsc0) * PM_TIMER_HZ / elapsed;
+}
+
+/* (hz << 32) / div, split so that hz << 32 cannot overflow */
+static u64 fp32_ratio(u64 hz, u64 div)
+{
+	return ((hz / div) << CALIB_FRAC_SHIFT) +
+		((hz % div) << CALIB_FRAC_SHIFT) / div;
+}
+
+void timebase_init(void)
+{
+	struct timebase *tb = &timebase;
+	u64 tsc_hz = 0, apic_hz = 0;
+	s64 ppm;
+	bool exact;
+
+	memset(tb, 0, sizeof(*tb));
+	tb->pm_tsc_hz = pm_timer_tsc_hz();
+
+	if (hv_frequency_msrs(&tsc_hz, &apic_hz)) {
+		tb->source = CALIB_HV_MSR;
+	} else if (cpuid_frequency(&tsc_hz, &apic_hz, &exact) && exact) {
+		tb->source = CALIB_CPUID_15;
+	} else if (tb->pm_tsc_hz) {
+		tb->source = CALIB_PM_TIMER;
+		tsc_hz = tb->pm_tsc_hz;
+		apic_hz = 0;
+	} else if (tsc_hz) {
+		tb->source = CALIB_CPUID_16;
+	} else {
+		printf("timebase: no TSC frequency source\n");
+		return;
+	}
+
+	tb->tsc_hz = tsc_hz;
+	tb->apic_hz = apic_hz;
+	tb->tsc_per_ns = fp32_ratio(tsc_hz, 1000000000);
+	tb->ns_per_tsc = fp32_ratio(1000000000, tsc_hz);
+	tb->tsc_per_100ns = fp32_ratio(tsc_hz, 10000000);
+	tb->ref_per_tsc = fp32_ratio(10000000, tsc_hz);
+	if (apic_hz)
+		tb->apic_per_ns = fp32_ratio(apic_hz, 1000000000);
+
+	printf("timebase: %s, tsc_hz %" PRIu64 ", apic_hz %" PRIu64 "\n",
+	       calib_source_name(tb->source), tb->tsc_hz, tb->apic_hz);
+	if (tb->pm_tsc_hz && tb->source != CALIB_PM_TIMER) {
+		ppm = ((s64)tb->pm_tsc_hz - (s64)tb->tsc_hz) * 1000000 /
+			(s64)tb->tsc_hz;
+		printf("timebase: PM timer measures %" PRIu64 " Hz (%" PRId64
+		       " ppm)\n", tb->pm_tsc_hz, ppm);
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef __X86_CALIBRATE__
+#define __X86_CALIBRATE__
+/*
+ * TSC and APIC timer frequency, taken from the best available source:
+ *
+ *  1. the Hyper-V HV_X64_MSR_TSC_FREQUENCY/APIC_FREQUENCY MSRs,
+ *  2. CPUID 0x15 (TSC/crystal ratio and crystal frequency),
+ *  3. a measurement against the ACPI PM timer,
+ *  4. the CPUID 0x16 base frequency.
+ *
+ * The PM timer measurement is also used to cross-check whichever source
+ * won. Converters between nanoseconds, 100ns reference counter ticks and
+ * TSC/APIC ticks use 32.32 fixed-point factors computed once, so deadline
+ * arithmetic costs a multiply instead of a 64-bit division.
+ */
+#include "libcflat.h"
+
+#define PM_TIMER_HZ		3579545
+#define PM_TIMER_MASK		0xffffff	/* 24-bit counter */
+#define CALIB_FRAC_SHIFT	32
+
+enum calib_source {
+	CALIB_NONE,
+	CALIB_HV_MSR,
+	CALIB_CPUID_15,
+	CALIB_PM_TIMER,
+	CALIB_CPUID_16,
+};
+
+struct timebase {
+	enum calib_source source;
+	u64 tsc_hz;
+	u64 apic_hz;		/* 0 if no source reports it */
+	u64 pm_tsc_hz;		/* PM timer measurement, 0 if unavailable */
+
+	/* 32.32 conversion factors */
+	u64 tsc_per_ns;
+	u64 ns_per_tsc;
+	u64 tsc_per_100ns;
+	u64 ref_per_tsc;	/* 100ns ticks per TSC tick */
+	u64 apic_per_ns;
+};
+
+extern struct timebase timebase;
+
+/* Fill timebase, print the chosen source and the PM timer cross-check */
+void timebase_init(void);
+const char *calib_source_name(enum calib_source source);
+
+/* (a * b) >> 32 without a 128-bit type, for both i386 and x86_64 */
+static inline u64 mul_u64_fp32(u64 a, u64 b)
+{
+	u64 al = (u32)a, ah = a >> 32, bl = (u32)b, bh = b >> 32;
+
+	return ((ah * bh) << 32) + ah * bl + al * bh + ((al * bl) >> 32);
+}
+
+static inline u64 ns_to_tsc(u64 ns)
+{
+	return mul_u64_fp32(ns, timebase.tsc_per_ns);
+}
+
+static inline u64 tsc_to_ns(u64 tsc)
+{
+	return mul_u64_fp32(tsc, timebase.ns_per_tsc);
+}
+
+/* @ticks in units of the Hyper-V reference counter (100ns) */
+static inline u64 ref_ticks_to_tsc(u64 ticks)
+{
+	return mul_u64_fp32(ticks, timebase.tsc_per_100ns);
+}
+
+static inline u64 tsc_to_ref_ticks(u64 tsc)
+{
+	return mul_u64_fp32(tsc, timebase.ref_per_tsc);
+}
+
+static inline u64 ns_to_apic(u64 ns)
+{
+	return mul_u64_fp32(ns, timebase.apic_per_ns);
+}
+
+#endif
@@ -0,0 +1,454 @@
+#include "hyperv.h"
+#include "asm/io.h"
+#include "asm/page.h"
+#include "smp.h"
+#include "alloc_page.h"
+#include "bitops.h"
+#include "stats.h"
+
+enum {
+    HV_TEST_DEV_SINT_ROUTE_CREATE = 1,
+    HV_TEST_DEV_SINT_ROUTE_DESTROY,
+    HV_TEST_DEV_SINT_ROUTE_SET_SINT,
+    HV_TEST_DEV_MSG_CONN_CREATE,
+    HV_TEST_DEV_MSG_CONN_DESTROY,
+    HV_TEST_DEV_EVT_CONN_CREATE,
+    HV_TEST_DEV_EVT_CONN_DESTROY,
+};
+
+static void synic_ctl(u32 ctl, u32 vcpu_id, u32 sint, u32 conn_id)
+{
+    outl((conn_id << 24) | (ctl << 16) | (vcpu_id << 8) | sint, 0x3000);
+}
+
+static void sint_enable(u8 sint, u8 vec, bool auto_eoi)
+{
+    wrmsr(HV_X64_MSR_SINT0 + sint,
+          (u64)vec | (auto_eoi ? HV_SYNIC_SINT_AUTO_EOI : 0));
+}
+
+static void sint_disable(u8 sint)
+{
+    wrmsr(HV_X64_MSR_SINT0 + sint, 0xff | HV_SYNIC_SINT_MASKED);
+}
+
+void synic_sint_create(u8 sint, u8 vec, bool auto_eoi)
+{
+    synic_ctl(HV_TEST_DEV_SINT_ROUTE_CREATE, smp_id(), sint, 0);
+    sint_enable(sint, vec, auto_eoi);
+}
+
+void synic_sint_set(u8 vcpu, u8 sint)
+{
+    synic_ctl(HV_TEST_DEV_SINT_ROUTE_SET_SINT, vcpu, sint, 0);
+}
+
+void synic_sint_destroy(u8 sint)
+{
+    sint_disable(sint);
+    synic_ctl(HV_TEST_DEV_SINT_ROUTE_DESTROY, smp_id(), sint, 0);
+}
+
+void msg_conn_create(u8 sint, u8 vec, u8 conn_id)
+{
+    synic_ctl(HV_TEST_DEV_MSG_CONN_CREATE, smp_id(), sint, conn_id);
+    sint_enable(sint, vec, true);
+}
+
+void msg_conn_destroy(u8 sint, u8 conn_id)
+{
+    sint_disable(sint);
+    synic_ctl(HV_TEST_DEV_MSG_CONN_DESTROY, 0, 0, conn_id);
+}
+
+void evt_conn_create(u8 sint, u8 vec, u8 conn_id)
+{
+    synic_ctl(HV_TEST_DEV_EVT_CONN_CREATE, smp_id(), sint, conn_id);
+    sint_enable(sint, vec, true);
+}
+
+void evt_conn_destroy(u8 sint, u8 conn_id)
+{
+    sint_disable(sint);
+    synic_ctl(HV_TEST_DEV_EVT_CONN_DESTROY, 0, 0, conn_id);
+}
+
+/*
+ * Hypercall page plus a preallocated, page-aligned input and output page
+ * per vCPU, so that callers never allocate on a hot path.
+ */
+void *hv_hypercall_page;
+
+struct hv_hypercall_pages {
+    void *input;
+    void *output;
+};
+
+static struct hv_hypercall_pages hv_pages[HV_MAX_CPUS];
+
+/* Cached CPUID 0x40000004.EBX, read once the hypercall page is set up */
+static u32 hv_spin_retries = HV_SPIN_WAIT_NEVER_NOTIFY;
+
+static void *hv_zalloc_page(void)
+{
+    void *page = alloc_page();
+
+    if (!page)
+        report_abort("failed to allocate Hyper-V page");
+    memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+void hv_setup_hypercall(void)
+{
+    int cpu, ncpus = MAX(cpu_count(), 1);
+
+    assert(ncpus <= HV_MAX_CPUS);
+
+    hv_hypercall_page = hv_zalloc_page();
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        hv_pages[cpu].input = hv_zalloc_page();
+        hv_pages[cpu].output = hv_zalloc_page();
+    }
+
+    wrmsr(HV_X64_MSR_GUEST_OS_ID, HV_TEST_GUEST_OS_ID);
+    wrmsr(HV_X64_MSR_HYPERCALL,
+          (u64)virt_to_phys(hv_hypercall_page) | HV_X64_MSR_HYPERCALL_ENABLE);
+
+    hv_spin_retries = hv_spin_wait_threshold();
+    if (!hv_spin_retries)
+        hv_spin_retries = HV_SPIN_WAIT_NEVER_NOTIFY;
+}
+
+void hv_teardown_hypercall(void)
+{
+    int cpu;
+
+    hv_spin_retries = HV_SPIN_WAIT_NEVER_NOTIFY;
+    wrmsr(HV_X64_MSR_HYPERCALL, 0);
+    wrmsr(HV_X64_MSR_GUEST_OS_ID, 0);
+
+    for (cpu = 0; cpu < HV_MAX_CPUS; cpu++) {
+        if (!hv_pages[cpu].input)
+            continue;
+        free_page(hv_pages[cpu].input);
+        free_page(hv_pages[cpu].output);
+        hv_pages[cpu].input = hv_pages[cpu].output = NULL;
+    }
+    free_page(hv_hypercall_page);
+    hv_hypercall_page = NULL;
+}
+
+void *hv_hypercall_input_page(void)
+{
+    void *page = hv_pages[smp_id()].input;
+
+    assert(page);
+    return page;
+}
+
+void *hv_hypercall_output_page(void)
+{
+    void *page = hv_pages[smp_id()].output;
+
+    assert(page);
+    return page;
+}
+
+/* VP assist pages of the vCPUs that enabled one, indexed like hv_pages */
+static struct hv_vp_assist_page *hv_assist[HV_MAX_CPUS];
+
+void hv_vp_assist_enable(void)
+{
+    struct hv_vp_assist_page *page = hv_zalloc_page();
+
+    assert(smp_id() < HV_MAX_CPUS && !hv_assist[smp_id()]);
+    hv_assist[smp_id()] = page;
+    wrmsr(HV_X64_MSR_VP_ASSIST_PAGE,
+          (u64)virt_to_phys(page) | HV_X64_MSR_VP_ASSIST_PAGE_ENABLE);
+}
+
+void hv_vp_assist_disable(void)
+{
+    struct hv_vp_assist_page *page = hv_assist[smp_id()];
+
+    wrmsr(HV_X64_MSR_VP_ASSIST_PAGE, 0);
+    hv_assist[smp_id()] = NULL;
+    if (page)
+        free_page(page);
+}
+
+struct hv_vp_assist_page *hv_vp_assist_page(void)
+{
+    return hv_assist[smp_id()];
+}
+
+/*
+ * EOI through the synthetic MSR, skipped when the hypervisor granted a
+ * lazy EOI in this vCPU's assist page. Returns whether the MSR was written.
+ */
+bool hv_apic_eoi(void)
+{
+    struct hv_vp_assist_page *page = hv_assist[smp_id()];
+    u32 assist = 0;
+
+    if (page) {
+        asm volatile("xchgl %0, %1"
+                     : "+r"(assist), "+m"(page->apic_assist) : : "memory");
+        if (assist & HV_VP_ASSIST_LAZY_EOI)
+            return false;
+    }
+    wrmsr(HV_X64_MSR_EOI, 0);
+    return true;
+}
+
+static u64 hv_gpa(void *va)
+{
+    return va ? virt_to_phys(va) : 0;
+}
+
+u64 hv_do_hypercall(u16 code, void *input, void *output)
+{
+    return hv_hypercall(hv_hypercall_control(code, false, 0, 0, 0),
+                        hv_gpa(input), hv_gpa(output));
+}
+
+u64 hv_do_fast_hypercall(u16 code, u64 input1, u64 input2)
+{
+    return hv_hypercall(hv_hypercall_control(code, true, 0, 0, 0),
+                        input1, input2);
+}
+
+/*
+ * Rep hypercall over @rep_count elements. The hypervisor may return
+ * after completing only part of the list (e.g. to deliver an interrupt);
+ * it then reports the number of elements done and the call is reissued
+ * with the rep start index advanced, until all elements are processed or
+ * an error is returned. @ncalls, if not NULL, receives the number of
+ * hypercalls that were needed.
+ */
+u64 hv_do_rep_hypercall(u16 code, u16 rep_count, u16 varhead_size,
+                        void *input, void *output, int *ncalls)
+{
+    u64 control = hv_hypercall_control(code, false, varhead_size, rep_count, 0);
+    u64 status;
+    u16 rep_start = 0, rep_comp;
+    int n = 0;
+
+    do {
+        status = hv_hypercall(control, hv_gpa(input), hv_gpa(output));
+        n++;
+        if (hv_result(status) != HV_STATUS_SUCCESS)
+            break;
+
+        rep_comp = hv_rep_comp(status);
+        if (rep_comp <= rep_start && rep_comp < rep_count) {
+            /* no forward progress, do not spin forever */
+            status = (status & ~HV_HYPERCALL_RESULT_MASK) |
+                     HV_STATUS_INVALID_HYPERCALL_INPUT;
+            break;
+        }
+        rep_start = rep_comp;
+        control &= ~HV_HYPERCALL_REP_START_MASK;
+        control |= (u64)rep_start << HV_HYPERCALL_REP_START_OFFSET;
+    } while (rep_start < rep_count);
+
+    if (ncalls)
+        *ncalls = n;
+    return status;
+}
+
+static u32 hv_vp_index_map[HV_MAX_CPUS];
+
+static void hv_read_vp_index(void *data)
+{
+    hv_vp_index_map[smp_id()] = rdmsr(HV_X64_MSR_VP_INDEX);
+}
+
+/*
+ * Record the VP index of every vCPU, indexed by APIC ID. Without the
+ * VP index MSR the VP index is assumed to equal the APIC ID.
+ */
+void hv_vp_index_map_init(void)
+{
+    bool msr = cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_VP_INDEX_AVAILABLE;
+    int cpu, ncpus = MAX(cpu_count(), 1);
+
+    assert(ncpus <= HV_MAX_CPUS);
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (msr)
+            on_cpu(cpu, hv_read_vp_index, NULL);
+        else
+            hv_vp_index_map[cpu] = cpu;
+    }
+}
+
+u32 hv_vp_index(int cpu)
+{
+    assert(cpu < HV_MAX_CPUS);
+    return hv_vp_index_map[cpu];
+}
+
+int hv_vp_index_to_cpu(u32 vp_index)
+{
+    int cpu, ncpus = MAX(cpu_count(), 1);
+
+    for (cpu = 0; cpu < ncpus; cpu++)
+        if (hv_vp_index_map[cpu] == vp_index)
+            return cpu;
+    return -1;
+}
+
+/*
+ * Encode @nr_vps VP indexes (any order, duplicates allowed) as a sparse
+ * 4K set. @vpset must have room for HV_VPSET_MAX_BANKS banks, which are
+ * first used as a scratch array indexed by bank number: a bank is
+ * initialized the first time it is hit, so nothing needs clearing up
+ * front. The present banks are then packed down in ascending order;
+ * bank n never moves up, so this is done in place.
+ *
+ * Returns the number of banks, or -1 if a VP index does not fit.
+ */
+int hv_vpset_encode(struct hv_vpset *vpset, const u32 *vps, int nr_vps)
+{
+    u64 valid = 0, *banks = vpset->bank_contents, bit;
+    int i, bank, nr_banks = 0;
+
+    for (i = 0; i < nr_vps; i++) {
+        if (vps[i] >= HV_VPSET_MAX_VP)
+            return -1;
+        bank = vps[i] / 64;
+        bit = 1ull << (vps[i] % 64);
+        if (valid & (1ull << bank)) {
+            banks[bank] |= bit;
+        } else {
+            valid |= 1ull << bank;
+            banks[bank] = bit;
+        }
+    }
+
+    for (bit = valid; bit; bit &= bit - 1)
+        banks[nr_banks++] = banks[__builtin_ctzll(bit)];
+
+    vpset->format = HV_GENERIC_SET_SPARSE_4K;
+    vpset->valid_bank_mask = valid;
+    return nr_banks;
+}
+
+/* HvCallSendSyntheticClusterIpi: both input qwords fit the fast call */
+u64 hv_send_ipi(u8 vector, u64 vp_mask)
+{
+    return hv_do_fast_hypercall(HVCALL_SEND_IPI, vector, vp_mask);
+}
+
+/* HvCallSendSyntheticClusterIpiEx through this CPU's input page */
+u64 hv_send_ipi_ex(u8 vector, const struct hv_vpset *vpset)
+{
+    struct hv_send_ipi_ex *ipi = hv_hypercall_input_page();
+    int nr_banks = hv_vpset_nr_banks(vpset);
+
+    ipi->vector = vector;
+    ipi->reserved = 0;
+    ipi->vp_set.format = vpset->format;
+    ipi->vp_set.valid_bank_mask = vpset->valid_bank_mask;
+    memcpy(ipi->vp_set.bank_contents, vpset->bank_contents,
+           nr_banks * sizeof(u64));
+
+    return hv_hypercall(hv_hypercall_control(HVCALL_SEND_IPI_EX, false,
+                                             nr_banks, 0, 0),
+                        hv_gpa(ipi), 0);
+}
+
+#define HV_EVENT_WORDS_PER_LINE (64 / sizeof(ulong))
+
+/*
+ * The page is scanned a cache line at a time with plain loads, and an
+ * all-zero line is skipped as a whole; only non-zero words are taken
+ * with an atomic exchange. A flag the hypervisor sets while we scan
+ * either lands in a word we took (and is reported), in a word we skipped
+ * or zeroed (and raises the SINT again).
+ */
+int hv_event_flags_drain(struct hv_event_flags *evt,
+                         void (*fn)(int flag, void *data), void *data)
+{
+    volatile ulong *flags = evt->flags;
+    int line, i, end, n = 0;
+    ulong word, any;
+
+    for (line = 0; line < ARRAY_SIZE(evt->flags);
+         line += HV_EVENT_WORDS_PER_LINE) {
+        end = MIN(line + HV_EVENT_WORDS_PER_LINE, ARRAY_SIZE(evt->flags));
+        for (any = 0, i = line; i < end; i++)
+            any |= flags[i];
+        if (!any)
+            continue;
+
+        for (i = line; i < end; i++) {
+            if (!flags[i])
+                continue;
+            word = 0;
+            asm volatile("xchg %0, %1" : "+r"(word), "+m"(flags[i])
+                         : : "memory");
+            while (word) {
+                fn(i * BITS_PER_LONG + __builtin_ctzl(word), data);
+                word &= word - 1;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+u64 hv_steal_bp(const struct hv_steal_sample *start,
+                const struct hv_steal_sample *end)
+{
+    u64 elapsed = end->ref - start->ref;
+    u64 ran = end->runtime - start->runtime;
+
+    /* the two MSRs are read apart, so a fully running vCPU can overshoot */
+    if (!elapsed || ran >= elapsed)
+        return 0;
+    return (elapsed - ran) * 10000 / elapsed;
+}
+
+void hv_steal_print(const struct hv_steal_sample *start,
+                    const struct hv_steal_sample *end,
+                    const char *name_fmt, ...)
+{
+    u64 bp = hv_steal_bp(start, end);
+    char name[64];
+    va_list va;
+
+    va_start(va, name_fmt);
+    vsnprintf(name, sizeof(name), name_fmt, va);
+    va_end(va);
+
+    printf("%s steal=" STATS_X100_FMT "%% ran=%" PRIu64
+           "us elapsed=%" PRIu64 "us\n", name, STATS_X100(bp),
+           (end->runtime - start->runtime) / 10,
+           (end->ref - start->ref) / 10);
+}
+
+u64 hv_spin_lock(struct spinlock *lock)
+{
+    volatile unsigned int *v = &lock->v;
+    u64 notified = 0, spins = 0;
+    u32 retries = hv_spin_retries;
+    u32 since_notify = 0;
+
+    while (__sync_lock_test_and_set(&lock->v, 1)) {
+        do {
+            pause();
+            spins++;
+            if (retries != HV_SPIN_WAIT_NEVER_NOTIFY &&
+                ++since_notify >= retries) {
+                /* the input is the number of failed attempts so far */
+                hv_do_fast_hypercall(HVCALL_NOTIFY_LONG_SPIN_WAIT, spins, 0);
+                since_notify = 0;
+                notified++;
+            }
+        } while (*v);
+    }
+    return notified;
+}
@@ -0,0 +1,572 @@
+#ifndef __HYPERV_H
+#define __HYPERV_H
+
+#include "libcflat.h"
+#include "processor.h"
+#include "asm/barrier.h"
+#include "asm/spinlock.h"
+
+#define HYPERV_CPUID_FEATURES                   0x40000003
+#define HYPERV_CPUID_ENLIGHTMENT_INFO           0x40000004
+
+#define HV_X64_MSR_VP_RUNTIME_AVAILABLE         (1 << 0)
+#define HV_X64_MSR_TIME_REF_COUNT_AVAILABLE     (1 << 1)
+#define HV_X64_MSR_SYNIC_AVAILABLE              (1 << 2)
+#define HV_X64_MSR_SYNTIMER_AVAILABLE           (1 << 3)
+#define HV_X64_MSR_APIC_ACCESS_AVAILABLE        (1 << 4)
+#define HV_X64_MSR_HYPERCALL_AVAILABLE          (1 << 5)
+#define HV_X64_MSR_VP_INDEX_AVAILABLE           (1 << 6)
+#define HV_X64_MSR_REFERENCE_TSC_AVAILABLE      (1 << 9)
+#define HV_X64_ACCESS_FREQUENCY_MSRS            (1 << 11)
+
+/* HYPERV_CPUID_FEATURES.EDX */
+#define HV_X64_HYPERCALL_XMM_INPUT_AVAILABLE    (1 << 4)
+#define HV_X64_GUEST_IDLE_STATE_AVAILABLE       (1 << 5)
+#define HV_STIMER_DIRECT_MODE_AVAILABLE         (1 << 19)
+
+/* HYPERV_CPUID_ENLIGHTMENT_INFO.EAX */
+#define HV_X64_AS_SWITCH_RECOMMENDED            (1 << 0)
+#define HV_X64_LOCAL_TLB_FLUSH_RECOMMENDED      (1 << 1)
+#define HV_X64_REMOTE_TLB_FLUSH_RECOMMENDED     (1 << 2)
+#define HV_X64_APIC_ACCESS_RECOMMENDED          (1 << 3)
+#define HV_X64_CLUSTER_IPI_RECOMMENDED          (1 << 10)
+#define HV_X64_EX_PROCESSOR_MASKS_RECOMMENDED   (1 << 11)
+
+#define HV_X64_MSR_GUEST_OS_ID                  0x40000000
+#define HV_X64_MSR_HYPERCALL                    0x40000001
+#define HV_X64_MSR_VP_INDEX                     0x40000002
+
+#define HV_X64_MSR_VP_RUNTIME                   0x40000010
+
+#define HV_X64_MSR_TIME_REF_COUNT               0x40000020
+#define HV_X64_MSR_REFERENCE_TSC                0x40000021
+#define HV_X64_MSR_TSC_FREQUENCY                0x40000022
+#define HV_X64_MSR_APIC_FREQUENCY               0x40000023
+
+/* Synthetic APIC registers, usable in xAPIC mode without MMIO exits */
+#define HV_X64_MSR_EOI                          0x40000070
+#define HV_X64_MSR_ICR                          0x40000071
+#define HV_X64_MSR_TPR                          0x40000072
+#define HV_X64_MSR_VP_ASSIST_PAGE               0x40000073
+
+#define HV_X64_MSR_VP_ASSIST_PAGE_ENABLE        0x1
+
+/* Define synthetic interrupt controller model specific registers. */
+#define HV_X64_MSR_SCONTROL                     0x40000080
+#define HV_X64_MSR_SVERSION                     0x40000081
+#define HV_X64_MSR_SIEFP                        0x40000082
+#define HV_X64_MSR_SIMP                         0x40000083
+#define HV_X64_MSR_EOM                          0x40000084
+#define HV_X64_MSR_SINT0                        0x40000090
+#define HV_X64_MSR_SINT1                        0x40000091
+#define HV_X64_MSR_SINT2                        0x40000092
+#define HV_X64_MSR_SINT3                        0x40000093
+#define HV_X64_MSR_SINT4                        0x40000094
+#define HV_X64_MSR_SINT5                        0x40000095
+#define HV_X64_MSR_SINT6                        0x40000096
+#define HV_X64_MSR_SINT7                        0x40000097
+#define HV_X64_MSR_SINT8                        0x40000098
+#define HV_X64_MSR_SINT9                        0x40000099
+#define HV_X64_MSR_SINT10                       0x4000009A
+#define HV_X64_MSR_SINT11                       0x4000009B
+#define HV_X64_MSR_SINT12                       0x4000009C
+#define HV_X64_MSR_SINT13                       0x4000009D
+#define HV_X64_MSR_SINT14                       0x4000009E
+#define HV_X64_MSR_SINT15                       0x4000009F
+
+/*
+ * Synthetic Timer MSRs. Four timers per vcpu.
+ */
+
+#define HV_X64_MSR_GUEST_IDLE                   0x400000F0
+
+#define HV_X64_MSR_STIMER0_CONFIG               0x400000B0
+#define HV_X64_MSR_STIMER0_COUNT                0x400000B1
+#define HV_X64_MSR_STIMER1_CONFIG               0x400000B2
+#define HV_X64_MSR_STIMER1_COUNT                0x400000B3
+#define HV_X64_MSR_STIMER2_CONFIG               0x400000B4
+#define HV_X64_MSR_STIMER2_COUNT                0x400000B5
+#define HV_X64_MSR_STIMER3_CONFIG               0x400000B6
+#define HV_X64_MSR_STIMER3_COUNT                0x400000B7
+
+#define HV_SYNIC_CONTROL_ENABLE                 (1ULL << 0)
+#define HV_SYNIC_SIMP_ENABLE                    (1ULL << 0)
+#define HV_SYNIC_SIEFP_ENABLE                   (1ULL << 0)
+#define HV_SYNIC_SINT_MASKED                    (1ULL << 16)
+#define HV_SYNIC_SINT_AUTO_EOI                  (1ULL << 17)
+#define HV_SYNIC_SINT_VECTOR_MASK               (0xFF)
+#define HV_SYNIC_SINT_COUNT                     16
+
+#define HV_STIMER_ENABLE                (1ULL << 0)
+#define HV_STIMER_PERIODIC              (1ULL << 1)
+#define HV_STIMER_LAZY                  (1ULL << 2)
+#define HV_STIMER_AUTOENABLE            (1ULL << 3)
+#define HV_STIMER_APIC_VECTOR(vec)      ((u64)((vec) & 0xFF) << 4)
+#define HV_STIMER_DIRECT_MODE           (1ULL << 12)
+#define HV_STIMER_SINT(config)          (__u8)(((config) >> 16) & 0x0F)
+
+#define HV_SYNIC_STIMER_COUNT           (4)
+
+/* Define synthetic interrupt controller message constants. */
+#define HV_MESSAGE_SIZE                 (256)
+#define HV_MESSAGE_PAYLOAD_BYTE_COUNT   (240)
+#define HV_MESSAGE_PAYLOAD_QWORD_COUNT  (30)
+
+/* Define hypervisor message types. */
+enum hv_message_type {
+        HVMSG_NONE                      = 0x00000000,
+
+        /* Memory access messages. */
+        HVMSG_UNMAPPED_GPA              = 0x80000000,
+        HVMSG_GPA_INTERCEPT             = 0x80000001,
+
+        /* Timer notification messages. */
+        HVMSG_TIMER_EXPIRED                     = 0x80000010,
+
+        /* Error messages. */
+        HVMSG_INVALID_VP_REGISTER_VALUE = 0x80000020,
+        HVMSG_UNRECOVERABLE_EXCEPTION   = 0x80000021,
+        HVMSG_UNSUPPORTED_FEATURE               = 0x80000022,
+
+        /* Trace buffer complete messages. */
+        HVMSG_EVENTLOG_BUFFERCOMPLETE   = 0x80000040,
+
+        /* Platform-specific processor intercept messages. */
+        HVMSG_X64_IOPORT_INTERCEPT              = 0x80010000,
+        HVMSG_X64_MSR_INTERCEPT         = 0x80010001,
+        HVMSG_X64_CPUID_INTERCEPT               = 0x80010002,
+        HVMSG_X64_EXCEPTION_INTERCEPT   = 0x80010003,
+        HVMSG_X64_APIC_EOI                      = 0x80010004,
+        HVMSG_X64_LEGACY_FP_ERROR               = 0x80010005
+};
+
+/* Define synthetic interrupt controller message flags. */
+union hv_message_flags {
+        uint8_t asu8;
+        struct {
+                uint8_t msg_pending:1;
+                uint8_t reserved:7;
+        };
+};
+
+union hv_port_id {
+        uint32_t asu32;
+        struct {
+                uint32_t id:24;
+                uint32_t reserved:8;
+        } u;
+};
+
+/* Define port type. */
+enum hv_port_type {
+        HVPORT_MSG      = 1,
+        HVPORT_EVENT            = 2,
+        HVPORT_MONITOR  = 3
+};
+
+/* Define synthetic interrupt controller message header. */
+struct hv_message_header {
+        uint32_t message_type;
+        uint8_t payload_size;
+        union hv_message_flags message_flags;
+        uint8_t reserved[2];
+        union {
+                uint64_t sender;
+                union hv_port_id port;
+        };
+};
+
+/* Define timer message payload structure. */
+struct hv_timer_message_payload {
+        uint32_t timer_index;
+        uint32_t reserved;
+        uint64_t expiration_time;       /* When the timer expired */
+        uint64_t delivery_time; /* When the message was delivered */
+};
+
+/* Define synthetic interrupt controller message format. */
+struct hv_message {
+        struct hv_message_header header;
+        union {
+                uint64_t payload[HV_MESSAGE_PAYLOAD_QWORD_COUNT];
+        } u;
+};
+
+/* Define the synthetic interrupt message page layout. */
+struct hv_message_page {
+        struct hv_message sint_message[HV_SYNIC_SINT_COUNT];
+};
+
+#define HV_EVENT_FLAGS_COUNT	(256 * 8)
+
+struct hv_event_flags {
+	ulong flags[HV_EVENT_FLAGS_COUNT / (8 * sizeof(ulong))];
+};
+
+struct hv_event_flags_page {
+	struct hv_event_flags slot[HV_SYNIC_SINT_COUNT];
+};
+
+#define HV_X64_MSR_HYPERCALL_ENABLE             0x1
+
+/* Guest OS ID written before enabling the hypercall page (open source, id 0xf00) */
+#define HV_TEST_GUEST_OS_ID                     (0x8f00ull << 48)
+
+/* Hypercall input value (control word) */
+#define HV_HYPERCALL_FAST               (1u << 16)
+#define HV_HYPERCALL_VARHEAD_OFFSET     17
+#define HV_HYPERCALL_VARHEAD_MASK       (0x3ffull << HV_HYPERCALL_VARHEAD_OFFSET)
+#define HV_HYPERCALL_REP_COMP_OFFSET    32
+#define HV_HYPERCALL_REP_COMP_MASK      (0xfffull << HV_HYPERCALL_REP_COMP_OFFSET)
+#define HV_HYPERCALL_REP_START_OFFSET   48
+#define HV_HYPERCALL_REP_START_MASK     (0xfffull << HV_HYPERCALL_REP_START_OFFSET)
+#define HV_HYPERCALL_RESULT_MASK        0xffffull
+
+/* Hypercall status codes (low 16 bits of the result value) */
+#define HV_STATUS_SUCCESS                       0
+#define HV_STATUS_INVALID_HYPERCALL_CODE        2
+#define HV_STATUS_INVALID_HYPERCALL_INPUT       3
+#define HV_STATUS_INVALID_ALIGNMENT             4
+#define HV_STATUS_INVALID_PARAMETER             5
+#define HV_STATUS_ACCESS_DENIED                 6
+#define HV_STATUS_INVALID_CONNECTION_ID         18
+#define HV_STATUS_INSUFFICIENT_BUFFERS          19
+
+#define HVCALL_FLUSH_VIRTUAL_ADDRESS_SPACE      0x0002
+#define HVCALL_FLUSH_VIRTUAL_ADDRESS_LIST       0x0003
+#define HVCALL_NOTIFY_LONG_SPIN_WAIT            0x0008
+#define HVCALL_SEND_IPI                         0x000b
+#define HVCALL_SEND_IPI_EX                      0x0015
+#define HVCALL_POST_MESSAGE                     0x5c
+#define HVCALL_SIGNAL_EVENT                     0x5d
+
+/* RDX + R8 + XMM0-XMM5 */
+#define HV_HYPERCALL_MAX_XMM_INPUT              112
+
+/* Upper bound on vCPUs, matches max_cpus in cstart*.S */
+#define HV_MAX_CPUS                             64
+
+struct hv_input_post_message {
+	u32 connectionid;
+	u32 reserved;
+	u32 message_type;
+	u32 payload_size;
+	u64 payload[HV_MESSAGE_PAYLOAD_QWORD_COUNT];
+};
+
+#define HV_FLUSH_ALL_PROCESSORS                 (1ull << 0)
+#define HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES     (1ull << 1)
+#define HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY       (1ull << 2)
+
+/* HvCallFlushVirtualAddressSpace/List input, gva_list is the rep list */
+struct hv_tlb_flush {
+	u64 address_space;
+	u64 flags;
+	u64 processor_mask;
+	u64 gva_list[];
+};
+
+/* Processor set formats of the Ex hypercalls */
+#define HV_GENERIC_SET_SPARSE_4K                0
+#define HV_GENERIC_SET_ALL                      1
+
+/*
+ * Sparse processor set: VP indexes are split into 64-VP banks, bit N of
+ * valid_bank_mask says bank N is present, and the present banks follow
+ * in bank_contents[] in ascending order.
+ */
+struct hv_vpset {
+	u64 format;
+	u64 valid_bank_mask;
+	u64 bank_contents[];
+};
+
+#define HV_VPSET_MAX_BANKS                      64
+#define HV_VPSET_MAX_VP                         (HV_VPSET_MAX_BANKS * 64)
+
+/* HvCallSendSyntheticClusterIpiEx input, the banks are the variable header */
+struct hv_send_ipi_ex {
+	u32 vector;
+	u32 reserved;
+	struct hv_vpset vp_set;
+};
+
+static inline bool synic_supported(void)
+{
+   return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_SYNIC_AVAILABLE;
+}
+
+static inline bool stimer_supported(void)
+{
+    return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_SYNIC_AVAILABLE;
+}
+
+static inline bool hv_time_ref_counter_supported(void)
+{
+    return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_TIME_REF_COUNT_AVAILABLE;
+}
+
+static inline bool hv_vp_runtime_supported(void)
+{
+	return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_VP_RUNTIME_AVAILABLE;
+}
+
+static inline bool hv_xmm_input_supported(void)
+{
+	return cpuid(HYPERV_CPUID_FEATURES).d & HV_X64_HYPERCALL_XMM_INPUT_AVAILABLE;
+}
+
+static inline bool hv_hypercall_supported(void)
+{
+	return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_HYPERCALL_AVAILABLE;
+}
+
+static inline bool hv_apic_access_supported(void)
+{
+	return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_APIC_ACCESS_AVAILABLE;
+}
+
+static inline bool hv_apic_access_recommended(void)
+{
+	return cpuid(HYPERV_CPUID_ENLIGHTMENT_INFO).a &
+		HV_X64_APIC_ACCESS_RECOMMENDED;
+}
+
+/* HYPERV_CPUID_ENLIGHTMENT_INFO.EBX, ~0 meaning never notify */
+#define HV_SPIN_WAIT_NEVER_NOTIFY               0xffffffff
+
+static inline u32 hv_spin_wait_threshold(void)
+{
+	return cpuid(HYPERV_CPUID_ENLIGHTMENT_INFO).b;
+}
+
+static inline bool hv_remote_tlb_flush_recommended(void)
+{
+	return cpuid(HYPERV_CPUID_ENLIGHTMENT_INFO).a &
+		HV_X64_REMOTE_TLB_FLUSH_RECOMMENDED;
+}
+
+static inline bool hv_cluster_ipi_recommended(void)
+{
+	return cpuid(HYPERV_CPUID_ENLIGHTMENT_INFO).a &
+		HV_X64_CLUSTER_IPI_RECOMMENDED;
+}
+
+static inline int hv_vpset_nr_banks(const struct hv_vpset *vpset)
+{
+	return __builtin_popcountll(vpset->valid_bank_mask);
+}
+
+static inline u64 hv_hypercall_control(u16 code, bool fast, u16 varhead_size,
+				       u16 rep_count, u16 rep_start)
+{
+	return (u64)code | (fast ? HV_HYPERCALL_FAST : 0) |
+		((u64)varhead_size << HV_HYPERCALL_VARHEAD_OFFSET) |
+		((u64)rep_count << HV_HYPERCALL_REP_COMP_OFFSET) |
+		((u64)rep_start << HV_HYPERCALL_REP_START_OFFSET);
+}
+
+static inline u16 hv_result(u64 status)
+{
+	return status & HV_HYPERCALL_RESULT_MASK;
+}
+
+static inline u16 hv_rep_comp(u64 status)
+{
+	return (status & HV_HYPERCALL_REP_COMP_MASK) >> HV_HYPERCALL_REP_COMP_OFFSET;
+}
+
+extern void *hv_hypercall_page;
+
+/*
+ * Raw call through the hypercall page. @control is the complete hypercall
+ * input value; @input and @output are guest physical addresses for
+ * memory-based calls, or the two input qwords for fast calls. Inlined so
+ * that benchmarks time nothing but the call itself.
+ */
+static inline u64 hv_hypercall(u64 control, u64 input, u64 output)
+{
+	u64 status;
+#ifdef __x86_64__
+	register u64 r8 asm("r8") = output;
+
+	asm volatile ("call *%[hcall_page]"
+		      : "=a"(status), "+c"(control), "+d"(input), "+r"(r8)
+		      : [hcall_page] "m" (hv_hypercall_page)
+		      : "r9", "r10", "r11", "cc", "memory");
+#else
+	u32 input_hi = input >> 32, input_lo = input;
+	u32 output_hi = output >> 32, output_lo = output;
+
+	asm volatile ("call *%[hcall_page]"
+		      : "=A"(status), "+b"(input_hi), "+c"(input_lo),
+			"+D"(output_hi), "+S"(output_lo)
+		      : "0"(control), [hcall_page] "m" (hv_hypercall_page)
+		      : "cc", "memory");
+#endif
+	return status;
+}
+
+#ifdef __x86_64__
+/*
+ * Fast hypercall with its input in registers only: bytes 0-15 of @input
+ * go in RDX/R8 and bytes 16-111 in XMM0-XMM5, so @input must always be
+ * HV_HYPERCALL_MAX_XMM_INPUT bytes long. Needs CR4.OSFXSR and
+ * hv_xmm_input_supported(). The XMM registers are not listed as
+ * clobbers because tests are built with -mno-sse and never hold live
+ * values in them.
+ */
+static inline u64 hv_hypercall_xmm(u64 control, const u64 *input)
+{
+	u64 status;
+	u64 input0 = input[0];
+	register u64 r8 asm("r8") = input[1];
+
+	asm volatile ("movdqu 0x10(%[in]), %%xmm0\n\t"
+		      "movdqu 0x20(%[in]), %%xmm1\n\t"
+		      "movdqu 0x30(%[in]), %%xmm2\n\t"
+		      "movdqu 0x40(%[in]), %%xmm3\n\t"
+		      "movdqu 0x50(%[in]), %%xmm4\n\t"
+		      "movdqu 0x60(%[in]), %%xmm5\n\t"
+		      "call *%[hcall_page]"
+		      : "=a"(status), "+c"(control), "+d"(input0), "+r"(r8)
+		      : [in] "r"(input), [hcall_page] "m" (hv_hypercall_page)
+		      : "r9", "r10", "r11", "cc", "memory");
+	return status;
+}
+#endif
+
+void hv_setup_hypercall(void);
+void hv_teardown_hypercall(void);
+void *hv_hypercall_input_page(void);
+void *hv_hypercall_output_page(void);
+u64 hv_do_hypercall(u16 code, void *input, void *output);
+u64 hv_do_fast_hypercall(u16 code, u64 input1, u64 input2);
+u64 hv_do_rep_hypercall(u16 code, u16 rep_count, u16 varhead_size,
+			void *input, void *output, int *ncalls);
+u64 hv_send_ipi(u8 vector, u64 vp_mask);
+void hv_vp_index_map_init(void);
+u32 hv_vp_index(int cpu);
+int hv_vp_index_to_cpu(u32 vp_index);
+int hv_vpset_encode(struct hv_vpset *vpset, const u32 *vps, int nr_vps);
+u64 hv_send_ipi_ex(u8 vector, const struct hv_vpset *vpset);
+
+/*
+ * First bytes of the VP assist page. The hypervisor sets
+ * HV_VP_ASSIST_LAZY_EOI in apic_assist when the interrupt it is injecting
+ * may be EOIed lazily; the guest then clears it instead of writing EOI.
+ * The rest of the page is for nested virtualization and is not used here.
+ */
+#define HV_VP_ASSIST_LAZY_EOI   (1 << 0)
+
+struct hv_vp_assist_page {
+	u32 apic_assist;
+	u32 reserved;
+};
+
+void hv_vp_assist_enable(void);
+void hv_vp_assist_disable(void);
+struct hv_vp_assist_page *hv_vp_assist_page(void);
+bool hv_apic_eoi(void);
+
+/*
+ * Steal time: VP_RUNTIME is the time this vCPU actually ran and
+ * TIME_REF_COUNT the partition's wall clock, both in 100ns units. Whatever
+ * elapsed without the vCPU running between two samples was stolen.
+ * Samples are per vCPU, so take both ends on the vCPU being measured.
+ */
+struct hv_steal_sample {
+	u64 runtime;
+	u64 ref;
+};
+
+static inline void hv_steal_sample(struct hv_steal_sample *s)
+{
+	s->runtime = rdmsr(HV_X64_MSR_VP_RUNTIME);
+	s->ref = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+}
+
+/* Stolen share of the interval in basis points (1/100 %), 0..10000 */
+u64 hv_steal_bp(const struct hv_steal_sample *start,
+                const struct hv_steal_sample *end);
+
+/* both MSRs hv_steal_sample() reads are there */
+static inline bool hv_steal_supported(void)
+{
+	return hv_vp_runtime_supported() && hv_time_ref_counter_supported();
+}
+
+/* "<name> steal=x.xx% ran=..us elapsed=..us" for benchmark annotations */
+void hv_steal_print(const struct hv_steal_sample *start,
+                    const struct hv_steal_sample *end,
+                    const char *name_fmt, ...)
+                    __attribute__((format(printf, 3, 4)));
+
+/*
+ * Test-and-test-and-set lock that issues HvCallNotifyLongSpinWait every
+ * hv_spin_wait_threshold() failed polls, so the hypervisor can run the
+ * preempted holder. Notifies only after hv_setup_hypercall(); release
+ * with spin_unlock(). Returns how many times the hypervisor was notified.
+ */
+u64 hv_spin_lock(struct spinlock *lock);
+
+void synic_sint_create(u8 sint, u8 vec, bool auto_eoi);
+void synic_sint_set(u8 vcpu, u8 sint);
+void synic_sint_destroy(u8 sint);
+void msg_conn_create(u8 sint, u8 vec, u8 conn_id);
+void msg_conn_destroy(u8 sint, u8 conn_id);
+void evt_conn_create(u8 sint, u8 vec, u8 conn_id);
+void evt_conn_destroy(u8 sint, u8 conn_id);
+
+/*
+ * Take and clear every set flag of one SINT, calling @fn for each flag
+ * number; returns how many were set.
+ */
+int hv_event_flags_drain(struct hv_event_flags *evt,
+                         void (*fn)(int flag, void *data), void *data);
+
+/* Written by the hypervisor at any time, hence the volatile fields */
+struct hv_reference_tsc_page {
+        volatile uint32_t tsc_sequence;
+        uint32_t res1;
+        volatile uint64_t tsc_scale;
+        volatile int64_t tsc_offset;
+};
+
+#ifdef __x86_64__
+/*
+ * Partition reference time (100ns units) from the reference TSC page,
+ * using the TLFS sequence protocol: the snapshot is retried whenever
+ * tsc_sequence changed under it, and each retry bumps @retries if it
+ * is not NULL. Returns false if the page is marked invalid (sequence
+ * 0), in which case the TIME_REF_COUNT MSR must be used instead.
+ */
+static inline bool hv_ref_tsc_read(volatile struct hv_reference_tsc_page *page,
+				   u64 *time, u64 *retries)
+{
+	u32 seq;
+	u64 scale, tsc;
+	s64 offset;
+
+	for (;;) {
+		seq = page->tsc_sequence;
+		if (seq == 0)
+			return false;
+		rmb();		/* fetch sequence before data */
+		scale = page->tsc_scale;
+		offset = page->tsc_offset;
+		tsc = rdtsc();
+		rmb();		/* test sequence after fetching data */
+		if (page->tsc_sequence == seq)
+			break;
+		if (retries)
+			(*retries)++;
+	}
+
+	*time = (u64)(((unsigned __int128)tsc * scale) >> 64) + offset;
+	return true;
+}
+#endif
+
+
+#endif
@@ -36,6 +36,7 @@
 #define X86_CR4_PAE    0x00000020
 #define X86_CR4_MCE    0x00000040
 #define X86_CR4_PCE    0x00000100
+#define X86_CR4_OSFXSR 0x00000200
 #define X86_CR4_UMIP   0x00000800
 #define X86_CR4_VMXE   0x00002000
 #define X86_CR4_PCIDE  0x00020000
@@ -0,0 +1,331 @@
+/*
+ * Replay of exit-causing access traces, see replay.h.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "desc.h"
+#include "alloc_page.h"
+#include "asm/io.h"
+#include "replay.h"
+
+static void *scratch_page;
+
+static u64 replay_arg(const struct replay_op *op)
+{
+	if (!(op->flags & REPLAY_ARG_PAGE))
+		return op->arg;
+
+	if (!scratch_page) {
+		scratch_page = alloc_pages(REPLAY_SCRATCH_ORDER);
+		if (!scratch_page)
+			report_abort("replay: failed to allocate scratch pages");
+		memset(scratch_page, 0, PAGE_SIZE << REPLAY_SCRATCH_ORDER);
+	}
+	return virt_to_phys(scratch_page) + op->arg;
+}
+
+static bool replay_rdmsr(u32 index)
+{
+	u32 a, d;
+
+	asm volatile(ASM_TRY("1f")
+		     "rdmsr\n\t"
+		     "1:"
+		     : "=a"(a), "=d"(d) : "c"(index) : "memory");
+	return exception_vector() == 0;
+}
+
+static bool replay_wrmsr(u32 index, u64 val)
+{
+	asm volatile(ASM_TRY("1f")
+		     "wrmsr\n\t"
+		     "1:"
+		     : : "a"((u32)val), "d"((u32)(val >> 32)), "c"(index)
+		     : "memory");
+	return exception_vector() == 0;
+}
+
+static void replay_in(const struct replay_op *op)
+{
+	switch (op->size) {
+	case 1:
+		inb(op->addr);
+		break;
+	case 2:
+		inw(op->addr);
+		break;
+	default:
+		inl(op->addr);
+		break;
+	}
+}
+
+static void replay_out(const struct replay_op *op, u64 val)
+{
+	switch (op->size) {
+	case 1:
+		outb(val, op->addr);
+		break;
+	case 2:
+		outw(val, op->addr);
+		break;
+	default:
+		outl(val, op->addr);
+		break;
+	}
+}
+
+static void replay_read(const struct replay_op *op)
+{
+	void *p = phys_to_virt(op->addr);
+
+	switch (op->size) {
+	case 1:
+		(void)*(volatile u8 *)p;
+		break;
+	case 2:
+		(void)*(volatile u16 *)p;
+		break;
+	case 4:
+		(void)*(volatile u32 *)p;
+		break;
+	default:
+		(void)*(volatile u64 *)p;
+		break;
+	}
+}
+
+static void replay_write(const struct replay_op *op, u64 val)
+{
+	void *p = phys_to_virt(op->addr);
+
+	switch (op->size) {
+	case 1:
+		*(volatile u8 *)p = val;
+		break;
+	case 2:
+		*(volatile u16 *)p = val;
+		break;
+	case 4:
+		*(volatile u32 *)p = val;
+		break;
+	default:
+		*(volatile u64 *)p = val;
+		break;
+	}
+}
+
+/* Returns false if the op faulted */
+static bool replay_op(const struct replay_op *op, u64 arg)
+{
+	switch (op->kind) {
+	case REPLAY_CPUID:
+		cpuid_indexed(op->addr, arg);
+		return true;
+	case REPLAY_RDMSR:
+		return replay_rdmsr(op->addr);
+	case REPLAY_WRMSR:
+		return replay_wrmsr(op->addr, arg);
+	case REPLAY_IN:
+		replay_in(op);
+		return true;
+	case REPLAY_OUT:
+		replay_out(op, arg);
+		return true;
+	case REPLAY_READ:
+		replay_read(op);
+		return true;
+	case REPLAY_WRITE:
+		replay_write(op, arg);
+		return true;
+	}
+	return false;
+}
+
+u64 replay_run(const struct replay_op *ops, int n, u64 *cycles, bool *faulted)
+{
+	u64 start, t, arg;
+	bool ok;
+	int i;
+
+	start = rdtsc();
+	for (i = 0; i < n; i++) {
+		arg = replay_arg(&ops[i]);
+		t = rdtsc();
+		ok = replay_op(&ops[i], arg);
+		t = rdtsc() - t;
+		if (cycles)
+			cycles[i] = t;
+		if (faulted)
+			faulted[i] = !ok;
+	}
+	return rdtsc() - start;
+}
+
+static const struct {
+	const char *name;
+	enum replay_kind kind;
+	u8 size;
+	int nargs;
+} replay_mnemonics[] = {
+	{ "cpuid", REPLAY_CPUID, 0, 1 },	/* subleaf is optional */
+	{ "rdmsr", REPLAY_RDMSR, 0, 1 },
+	{ "wrmsr", REPLAY_WRMSR, 0, 2 },
+	{ "inb", REPLAY_IN, 1, 1 },
+	{ "inw", REPLAY_IN, 2, 1 },
+	{ "inl", REPLAY_IN, 4, 1 },
+	{ "outb", REPLAY_OUT, 1, 2 },
+	{ "outw", REPLAY_OUT, 2, 2 },
+	{ "outl", REPLAY_OUT, 4, 2 },
+	{ "readb", REPLAY_READ, 1, 1 },
+	{ "readw", REPLAY_READ, 2, 1 },
+	{ "readl", REPLAY_READ, 4, 1 },
+	{ "readq", REPLAY_READ, 8, 1 },
+	{ "writeb", REPLAY_WRITE, 1, 2 },
+	{ "writew", REPLAY_WRITE, 2, 2 },
+	{ "writel", REPLAY_WRITE, 4, 2 },
+	{ "writeq", REPLAY_WRITE, 8, 2 },
+};
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static bool is_sep(char c)
+{
+	return !c || c == ';' || c == '\n';
+}
+
+/* Copy the next blank-delimited word of the current op into @word */
+static const char *next_word(const char *s, char *word, int len)
+{
+	int i = 0;
+
+	while (is_space(*s))
+		s++;
+	while (!is_sep(*s) && !is_space(*s)) {
+		if (i < len - 1)
+			word[i++] = *s;
+		s++;
+	}
+	word[i] = '\0';
+	return s;
+}
+
+static bool parse_u64(const char *s, u64 *val)
+{
+	unsigned base = 10, digit;
+	u64 v = 0;
+
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		base = 16;
+		s += 2;
+	}
+	if (!*s)
+		return false;
+
+	for (; *s; s++) {
+		if (*s >= '0' && *s <= '9')
+			digit = *s - '0';
+		else if (base == 16 && *s >= 'a' && *s <= 'f')
+			digit = *s - 'a' + 10;
+		else if (base == 16 && *s >= 'A' && *s <= 'F')
+			digit = *s - 'A' + 10;
+		else
+			return false;
+		v = v * base + digit;
+	}
+	*val = v;
+	return true;
+}
+
+static bool parse_arg(const char *s, struct replay_op *op)
+{
+	if (strncmp(s, "page", 4))
+		return parse_u64(s, &op->arg);
+
+	op->flags |= REPLAY_ARG_PAGE;
+	op->arg = 0;
+	return !s[4] || (s[4] == '+' && parse_u64(s + 5, &op->arg));
+}
+
+int replay_parse(const char *text, struct replay_op *ops, int max)
+{
+	const char *s = text, *op_start;
+	char word[24], line[64];
+	struct replay_op *op;
+	int i, n = 0;
+
+	while (*s) {
+		while (is_space(*s) || *s == ';' || *s == '\n')
+			s++;
+		if (!*s)
+			break;
+
+		op_start = s;
+		s = next_word(s, word, sizeof(word));
+		for (i = 0; i < ARRAY_SIZE(replay_mnemonics); i++)
+			if (!strcmp(word, replay_mnemonics[i].name))
+				break;
+		if (i == ARRAY_SIZE(replay_mnemonics) || n == max)
+			goto bad;
+
+		op = &ops[n];
+		memset(op, 0, sizeof(*op));
+		op->kind = replay_mnemonics[i].kind;
+		op->size = replay_mnemonics[i].size;
+
+		s = next_word(s, word, sizeof(word));
+		if (!parse_u64(word, &op->addr))
+			goto bad;
+
+		s = next_word(s, word, sizeof(word));
+		if (replay_mnemonics[i].nargs == 2 || word[0]) {
+			if (replay_mnemonics[i].nargs == 1 &&
+			    op->kind != REPLAY_CPUID)
+				goto bad;
+			if (!parse_arg(word, op))
+				goto bad;
+		}
+
+		s = next_word(s, word, sizeof(word));
+		if (word[0])
+			goto bad;
+		n++;
+	}
+	return n;
+
+bad:
+	for (i = 0; i < sizeof(line) - 1 && !is_sep(op_start[i]); i++)
+		line[i] = op_start[i];
+	line[i] = '\0';
+	printf("replay: bad op %d: %s\n", n, line);
+	return -1;
+}
+
+void replay_format(const struct replay_op *op, char *buf, int len)
+{
+	const char *name = "?";
+	int i, nargs = 1;
+
+	for (i = 0; i < ARRAY_SIZE(replay_mnemonics); i++) {
+		if (replay_mnemonics[i].kind == op->kind &&
+		    replay_mnemonics[i].size == op->size) {
+			name = replay_mnemonics[i].name;
+			nargs = replay_mnemonics[i].nargs;
+			break;
+		}
+	}
+	if (op->kind == REPLAY_CPUID && op->arg)
+		nargs = 2;
+
+	if (nargs == 1)
+		snprintf(buf, len, "%s 0x%" PRIx64, name, op->addr);
+	else if (op->flags & REPLAY_ARG_PAGE)
+		snprintf(buf, len, "%s 0x%" PRIx64 " page+0x%" PRIx64,
+			 name, op->addr, op->arg);
+	else
+		snprintf(buf, len, "%s 0x%" PRIx64 " 0x%" PRIx64,
+			 name, op->addr, op->arg);
+}
@@ -0,0 +1,59 @@
+#ifndef _X86_REPLAY_H_
+#define _X86_REPLAY_H_
+/*
+ * Replay of a fixed sequence of exit-causing accesses (CPUID, MSR reads
+ * and writes, port I/O, MMIO), each timed with rdtsc.
+ *
+ * A trace is either a compiled-in table of struct replay_op or text, for
+ * example from an environment variable:
+ *
+ *   cpuid 0x40000000; rdmsr 0x40000000; outb 0x70 0; inb 0x71
+ *
+ * Ops are separated by ';' or newlines. Mnemonics are cpuid LEAF
+ * [SUBLEAF], rdmsr MSR, wrmsr MSR VALUE, in{b,w,l} PORT,
+ * out{b,w,l} PORT VALUE, read{b,w,l,q} PADDR and write{b,w,l,q} PADDR
+ * VALUE. A value of "page" or "page+N" stands for a physical address in
+ * a zeroed scratch area of two pages, for MSRs that take a page such as
+ * the hypercall and reference TSC page MSRs (one page each).
+ * Faulting ops (#GP on an MSR the platform does not have) are recorded,
+ * not fatal.
+ */
+#include "libcflat.h"
+
+enum replay_kind {
+	REPLAY_CPUID,
+	REPLAY_RDMSR,
+	REPLAY_WRMSR,
+	REPLAY_IN,
+	REPLAY_OUT,
+	REPLAY_READ,
+	REPLAY_WRITE,
+};
+
+/* replay_op.flags: add the scratch area address to @arg */
+#define REPLAY_ARG_PAGE		(1 << 0)
+#define REPLAY_SCRATCH_ORDER	1
+
+struct replay_op {
+	enum replay_kind kind;
+	u8 size;	/* access width in bytes, port I/O and MMIO only */
+	u8 flags;
+	u64 addr;	/* CPUID leaf, MSR index, port or physical address */
+	u64 arg;	/* CPUID subleaf or the value written */
+};
+
+/* Parse @text into at most @max ops; returns the count or -1 on error */
+extern int replay_parse(const char *text, struct replay_op *ops, int max);
+
+/* "wrmsr 0x40000000 0x1" form of @op, for reports */
+extern void replay_format(const struct replay_op *op, char *buf, int len);
+
+/*
+ * Execute @ops in order, storing each op's cost in TSC cycles to
+ * @cycles[i] and whether it faulted to @faulted[i] (either may be NULL).
+ * Returns the cycles for the whole trace, loop overhead included.
+ */
+extern u64 replay_run(const struct replay_op *ops, int n, u64 *cycles,
+		      bool *faulted);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * Clock source comparison: read cost, resolution and monotonicity
+ *
+ * Every clock the guest can see is driven through the same loop: RDTSC,
+ * RDTSCP, the Hyper-V reference TSC page, the TIME_REF_COUNT MSR,
+ * kvmclock, the ACPI PM timer and the HPET main counter. tsc.c,
+ * hyperv_clock.c and kvmclock_test.c check each of them for correctness
+ * in their own way; this puts the numbers side by side.
+ *
+ * Each vCPU in turn does CLK_BATCHES batches of CLK_BATCH back-to-back
+ * reads. The cost per read is the batch time over CLK_BATCH, in TSC
+ * cycles; the observed resolution is the smallest non-zero step between
+ * two reads, and a step that goes backwards (modulo the counter width) is
+ * a monotonicity violation. Then all vCPUs read at once, first unlocked
+ * to time reads under contention, then serialized by a lock against a
+ * shared last value, which catches warps between vCPUs.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "atomic.h"
+#include "alloc_page.h"
+#include "acpi.h"
+#include "asm/io.h"
+#include "asm/spinlock.h"
+#include "hyperv.h"
+#include "calibrate.h"
+#include "stats.h"
+#include "kvmclock.h"
+
+#define CLK_BATCH 16
+#define CLK_BATCHES 1024
+#define CLK_CONC_BATCHES 256
+#define CLK_CONC_READS 4096
+#define CLK_MAX_CPUS 16
+
+#define HPET_CAP		0x000
+#define HPET_CONFIG		0x010
+#define HPET_CONFIG_ENABLE	(1 << 0)
+#define HPET_COUNTER		0x0f0
+
+#define KVM_FEATURE_CLOCKSOURCE2 (1 << 3)
+
+struct clock_source {
+	const char *name;
+	/* false if the source is absent, else stores its frequency to @hz */
+	bool (*setup)(u64 *hz);
+	u64 (*read)(void);
+	void (*teardown)(void);
+	u64 mask;		/* counter width, for wrap-around */
+};
+
+struct clock_result {
+	u64 reads;
+	u64 same;		/* reads that returned the previous value */
+	u64 min_step;		/* smallest non-zero forward step, 0 if none */
+	u64 backward;
+	u64 max_backward;
+};
+
+static u64 samples[CLK_MAX_CPUS * CLK_CONC_BATCHES];
+static struct clock_result results[CLK_MAX_CPUS];
+
+static const struct clock_source *clk;
+static u64 clk_hz;
+
+static struct spinlock warp_lock;
+static u64 warp_last;
+static u64 warps, max_warp;
+static atomic_t ready, done;
+static volatile bool go;
+
+static u16 pm_timer_port;
+static volatile u8 *hpet;
+static u32 hpet_config;
+#ifdef __x86_64__
+static struct hv_reference_tsc_page *ref_tsc_page;
+#endif
+
+static bool tsc_setup(u64 *hz)
+{
+	*hz = timebase.tsc_hz;
+	return true;
+}
+
+static u64 tsc_read(void)
+{
+	return rdtsc();
+}
+
+static bool rdtscp_setup(u64 *hz)
+{
+	*hz = timebase.tsc_hz;
+	return cpuid(0x80000001).d & (1 << 27);
+}
+
+static u64 rdtscp_read(void)
+{
+	u32 aux;
+
+	return rdtscp(&aux);
+}
+
+#ifdef __x86_64__
+static bool ref_tsc_setup(u64 *hz)
+{
+	if (!(cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_REFERENCE_TSC_AVAILABLE))
+		return false;
+
+	ref_tsc_page = alloc_page();
+	memset(ref_tsc_page, 0, PAGE_SIZE);
+	wrmsr(HV_X64_MSR_REFERENCE_TSC, virt_to_phys(ref_tsc_page) | 1);
+	*hz = 10000000;
+	if (ref_tsc_page->tsc_sequence)
+		return true;
+
+	/* the page is marked invalid, e.g. no invariant TSC */
+	wrmsr(HV_X64_MSR_REFERENCE_TSC, 0);
+	free_page(ref_tsc_page);
+	return false;
+}
+
+static u64 ref_tsc_read(void)
+{
+	u64 t = 0;
+
+	hv_ref_tsc_read(ref_tsc_page, &t, NULL);
+	return t;
+}
+
+static void ref_tsc_teardown(void)
+{
+	wrmsr(HV_X64_MSR_REFERENCE_TSC, 0);
+	free_page(ref_tsc_page);
+}
+#endif
+
+static bool time_ref_setup(u64 *hz)
+{
+	*hz = 10000000;
+	return hv_time_ref_counter_supported();
+}
+
+static u64 time_ref_read(void)
+{
+	return rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+}
+
+/* KVM leaves 0x40000000 to Hyper-V when both are exposed */
+static bool kvmclock_setup(u64 *hz)
+{
+	struct cpuid sig;
+	u32 base;
+
+	for (base = 0x40000000; base < 0x40010000; base += 0x100) {
+		sig = cpuid(base);
+		if (sig.b == 0x4b4d564b && sig.c == 0x564b4d56 && sig.d == 0x4d)
+			break;
+	}
+	if (base == 0x40010000 ||
+	    !(cpuid(base + 1).a & KVM_FEATURE_CLOCKSOURCE2))
+		return false;
+
+	/* measure the raw pvclock, not kvmclock.c's global clamp */
+	pvclock_set_flags(PVCLOCK_RAW_CYCLE_BIT);
+	on_cpus(kvm_clock_init, NULL);
+	*hz = NSEC_PER_SEC;
+	return true;
+}
+
+static u64 kvmclock_read(void)
+{
+	return kvm_clock_read();
+}
+
+static void kvmclock_teardown(void)
+{
+	on_cpus(kvm_clock_clear, NULL);
+	pvclock_set_flags(0);
+}
+
+static bool pm_timer_setup(u64 *hz)
+{
+	struct fadt_descriptor_rev1 *fadt;
+
+	fadt = find_acpi_table_addr(FACP_SIGNATURE);
+	if (!fadt || !fadt->pm_tmr_blk)
+		return false;
+	pm_timer_port = fadt->pm_tmr_blk;
+	*hz = PM_TIMER_HZ;
+	return true;
+}
+
+static u64 pm_timer_read(void)
+{
+	return inl(pm_timer_port) & PM_TIMER_MASK;
+}
+
+static u32 hpet_readl(u32 reg)
+{
+	return *(volatile u32 *)(hpet + reg);
+}
+
+static void hpet_writel(u32 reg, u32 val)
+{
+	*(volatile u32 *)(hpet + reg) = val;
+}
+
+static bool hpet_setup(u64 *hz)
+{
+	struct hpet_descriptor_rev1 *desc;
+	u32 period_fs;
+
+	desc = find_acpi_table_addr(HPET_SIGNATURE);
+	if (!desc || desc->space_id != 0 || !desc->address)
+		return false;
+	hpet = phys_to_virt(desc->address);
+
+	/* counter period in femtoseconds, at most 100ns per the spec */
+	period_fs = hpet_readl(HPET_CAP + 4);
+	if (!period_fs || period_fs > 100000000)
+		return false;
+	*hz = 1000000000000000ull / period_fs;
+
+	hpet_config = hpet_readl(HPET_CONFIG);
+	hpet_writel(HPET_CONFIG, hpet_config | HPET_CONFIG_ENABLE);
+	return true;
+}
+
+/* Only the low 32 bits are read, so i386 needs no split 64-bit read */
+static u64 hpet_read(void)
+{
+	return hpet_readl(HPET_COUNTER);
+}
+
+static void hpet_teardown(void)
+{
+	hpet_writel(HPET_CONFIG, hpet_config);
+}
+
+static const struct clock_source sources[] = {
+	{ "rdtsc", tsc_setup, tsc_read, NULL, ~0ull },
+	{ "rdtscp", rdtscp_setup, rdtscp_read, NULL, ~0ull },
+#ifdef __x86_64__
+	{ "hv_ref_tsc_page", ref_tsc_setup, ref_tsc_read, ref_tsc_teardown,
+	  ~0ull },
+#endif
+	{ "hv_time_ref_count", time_ref_setup, time_ref_read, NULL, ~0ull },
+	{ "kvmclock", kvmclock_setup, kvmclock_read, kvmclock_teardown, ~0ull },
+	{ "acpi_pm_timer", pm_timer_setup, pm_timer_read, NULL,
+	  PM_TIMER_MASK },
+	{ "hpet", hpet_setup, hpet_read, hpet_teardown, 0xffffffff },
+};
+
+/*
+ * Fold one read into @r. A masked step in the upper half of the counter
+ * range is a step backwards, anything else is forward.
+ */
+static void account(struct clock_result *r, u64 prev, u64 cur)
+{
+	u64 step = (cur - prev) & clk->mask;
+
+	r->reads++;
+	if (!step) {
+		r->same++;
+	} else if (step > clk->mask / 2) {
+		step = (prev - cur) & clk->mask;
+		r->backward++;
+		r->max_backward = MAX(r->max_backward, step);
+	} else if (!r->min_step || step < r->min_step) {
+		r->min_step = step;
+	}
+}
+
+/* Time @nbatches batches into @out, folding every read into @r */
+static void read_batches(struct clock_result *r, u64 *out, int nbatches)
+{
+	u64 prev, cur, t;
+	int i, j;
+
+	memset(r, 0, sizeof(*r));
+	prev = clk->read();
+	for (i = 0; i < nbatches; i++) {
+		t = rdtsc();
+		for (j = 0; j < CLK_BATCH; j++) {
+			cur = clk->read();
+			account(r, prev, cur);
+			prev = cur;
+		}
+		out[i] = (rdtsc() - t) / CLK_BATCH;
+	}
+}
+
+static void per_cpu_read(void *data)
+{
+	read_batches(data, samples, CLK_BATCHES);
+}
+
+static void print_result(const char *name, const struct clock_result *r)
+{
+	u64 ps = clk_hz ? r->min_step * 1000000000000ull / clk_hz : 0;
+
+	printf("%s resolution=%" PRIu64 " ticks (%" PRIu64 " ps) same=%"
+	       PRIu64 "/%" PRIu64 " backward=%" PRIu64 " max_backward=%"
+	       PRIu64 "\n", name, r->min_step, ps, r->same, r->reads,
+	       r->backward, r->max_backward);
+}
+
+static bool per_cpu(void)
+{
+	struct clock_result r;
+	struct stats st;
+	char name[48];
+	bool ok = true;
+	int cpu;
+
+	for (cpu = 0; cpu < cpu_count(); cpu++) {
+		on_cpu(cpu, per_cpu_read, &r);
+		stats_compute(samples, CLK_BATCHES, &st);
+		snprintf(name, sizeof(name), "%s cpu%d", clk->name, cpu);
+		stats_print(name, &st);
+		print_result(name, &r);
+		ok &= !r.backward;
+	}
+	return ok;
+}
+
+static void warp_check(void)
+{
+	u64 cur, step;
+	int i;
+
+	for (i = 0; i < CLK_CONC_READS; i++) {
+		spin_lock(&warp_lock);
+		cur = clk->read();
+		step = (cur - warp_last) & clk->mask;
+		if (step > clk->mask / 2) {
+			warps++;
+			max_warp = MAX(max_warp, (warp_last - cur) & clk->mask);
+		}
+		warp_last = cur;
+		spin_unlock(&warp_lock);
+	}
+}
+
+/* @data is the vCPU's slot in results[] and samples[] */
+static void concurrent_read(void *data)
+{
+	long slot = (long)data;
+
+	atomic_inc(&ready);
+	while (!go)
+		pause();
+
+	read_batches(&results[slot], samples + slot * CLK_CONC_BATCHES,
+		     CLK_CONC_BATCHES);
+	warp_check();
+	atomic_inc(&done);
+}
+
+static bool concurrent(int ncpus)
+{
+	struct clock_result total = {};
+	struct stats st;
+	char name[48];
+	int cpu;
+
+	atomic_set(&ready, 0);
+	atomic_set(&done, 0);
+	go = false;
+	warps = max_warp = 0;
+	warp_last = clk->read();
+
+	for (cpu = 1; cpu < ncpus; cpu++)
+		on_cpu_async(cpu, concurrent_read, (void *)(long)cpu);
+	while (atomic_read(&ready) != ncpus - 1)
+		pause();
+	go = true;
+	concurrent_read((void *)0l);
+	while (atomic_read(&done) != ncpus)
+		pause();
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		total.reads += results[cpu].reads;
+		total.same += results[cpu].same;
+		total.backward += results[cpu].backward;
+		total.max_backward = MAX(total.max_backward,
+					 results[cpu].max_backward);
+		if (results[cpu].min_step &&
+		    (!total.min_step || results[cpu].min_step < total.min_step))
+			total.min_step = results[cpu].min_step;
+	}
+
+	stats_compute(samples, ncpus * CLK_CONC_BATCHES, &st);
+	snprintf(name, sizeof(name), "%s %d cpus", clk->name, ncpus);
+	stats_print(name, &st);
+	print_result(name, &total);
+	printf("%s cross-cpu warps=%" PRIu64 " max_warp=%" PRIu64 "\n",
+	       name, warps, max_warp);
+	return !total.backward && !warps;
+}
+
+int main(int ac, char **av)
+{
+	int i, ncpus;
+
+	setup_vm();
+	smp_init();
+	timebase_init();
+
+	ncpus = MIN(cpu_count(), CLK_MAX_CPUS);
+	for (i = 0; i < ARRAY_SIZE(sources); i++) {
+		clk = &sources[i];
+		clk_hz = 0;
+		if (!clk->setup(&clk_hz)) {
+			report_skip("%s not available", clk->name);
+			continue;
+		}
+
+		printf("%s: %" PRIu64 " Hz\n", clk->name, clk_hz);
+		report("%s monotonic on each cpu", per_cpu(), clk->name);
+		if (ncpus > 1)
+			report("%s monotonic across %d cpus", concurrent(ncpus),
+			       clk->name, ncpus);
+		if (clk->teardown)
+			clk->teardown();
+	}
+
+	return report_summary();
+}
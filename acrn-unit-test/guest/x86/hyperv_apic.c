@@ -0,0 +1,236 @@
+/*
+ * Synthetic APIC MSRs and VP assist page: functional checks and cost
+ *
+ * TPR write, EOI and self-IPI are timed through the regular APIC (xAPIC
+ * MMIO, then x2APIC MSRs after switching modes) and through the Hyper-V
+ * synthetic EOI/ICR/TPR MSRs. Two more variants drop the EOI write: lazy
+ * EOI through the VP assist page, and auto-EOI, which KVM applies to any
+ * interrupt whose vector belongs to an unmasked auto-EOI SINT.
+ *
+ * self_ipi is the round trip from the ICR write to the handler's return,
+ * eoi the handler's own EOI cost, both in TSC cycles.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "hyperv.h"
+#include "stats.h"
+
+#define APIC_BENCH_VEC 0xe2
+#define AUTO_EOI_VEC 0xe3
+#define AUTO_EOI_SINT 2
+
+#define APIC_WARMUP 16
+#define APIC_SAMPLES 1024
+#define APIC_TIMEOUT 1000000000ull
+
+struct apic_method {
+	u8 vec;
+	void (*set_tpr)(u8 tpr);
+	void (*self_ipi)(u8 vec);
+	void (*eoi)(void);
+};
+
+static const struct apic_method *cur;
+static volatile bool irq_seen;
+static volatile u64 eoi_cost;
+static u64 lazy_skipped;
+
+static u64 tpr_samples[APIC_SAMPLES];
+static u64 ipi_samples[APIC_SAMPLES];
+static u64 eoi_samples[APIC_SAMPLES];
+
+static void apic_set_taskpri(u8 tpr)
+{
+	apic_write(APIC_TASKPRI, tpr);
+}
+
+static void apic_self_ipi(u8 vec)
+{
+	apic_icr_write(APIC_DEST_SELF | APIC_DM_FIXED | vec, 0);
+}
+
+static void hv_set_tpr(u8 tpr)
+{
+	wrmsr(HV_X64_MSR_TPR, tpr);
+}
+
+static void hv_self_ipi(u8 vec)
+{
+	wrmsr(HV_X64_MSR_ICR, APIC_DEST_SELF | APIC_DM_FIXED | vec);
+}
+
+static void hv_eoi(void)
+{
+	wrmsr(HV_X64_MSR_EOI, 0);
+}
+
+static void hv_lazy_eoi(void)
+{
+	if (!hv_apic_eoi())
+		lazy_skipped++;
+}
+
+/* the lib apic ops: xAPIC MMIO, or the x2APIC MSRs after enable_x2apic() */
+static const struct apic_method apic_method = {
+	APIC_BENCH_VEC, apic_set_taskpri, apic_self_ipi, eoi,
+};
+
+static const struct apic_method hv_method = {
+	APIC_BENCH_VEC, hv_set_tpr, hv_self_ipi, hv_eoi,
+};
+
+static const struct apic_method hv_lazy_method = {
+	APIC_BENCH_VEC, hv_set_tpr, hv_self_ipi, hv_lazy_eoi,
+};
+
+static const struct apic_method hv_auto_method = {
+	AUTO_EOI_VEC, hv_set_tpr, hv_self_ipi, NULL,
+};
+
+static void bench_isr(isr_regs_t *regs)
+{
+	u64 t = rdtsc();
+
+	if (cur->eoi)
+		cur->eoi();
+	eoi_cost = rdtsc() - t;
+	irq_seen = true;
+}
+
+static bool tpr_sample(int i, u64 *out, void *data)
+{
+	u64 t = rdtsc();
+
+	cur->set_tpr(i & 1 ? 0x10 : 0);
+	*out = rdtsc() - t;
+	return true;
+}
+
+/* stats_sample() callback; EOI cost goes to eoi_samples[i] */
+static bool self_ipi_sample(int i, u64 *ipi, void *data)
+{
+	u64 t0;
+
+	irq_seen = false;
+	t0 = rdtsc();
+	cur->self_ipi(cur->vec);
+	while (!irq_seen) {
+		if (rdtsc() - t0 > APIC_TIMEOUT)
+			return false;
+		pause();
+	}
+	*ipi = rdtsc() - t0;
+	if (i >= 0)
+		eoi_samples[i] = eoi_cost;
+	return true;
+}
+
+static bool apic_bench(const char *name, const struct apic_method *m)
+{
+	bool ok;
+
+	cur = m;
+	lazy_skipped = 0;
+
+	stats_sample(tpr_sample, NULL, 0, tpr_samples, APIC_SAMPLES);
+	m->set_tpr(0);
+
+	irq_enable();
+	ok = stats_sample(self_ipi_sample, NULL, APIC_WARMUP,
+			  ipi_samples, APIC_SAMPLES);
+	irq_disable();
+
+	if (!ok) {
+		printf("%s: self-IPI not delivered\n", name);
+		return false;
+	}
+
+	stats_report(tpr_samples, APIC_SAMPLES, NULL, "%s tpr_write", name);
+	stats_report(eoi_samples, APIC_SAMPLES, NULL, "%s eoi", name);
+	stats_report(ipi_samples, APIC_SAMPLES, NULL, "%s self_ipi", name);
+
+	/* a missed EOI leaves the vector in service */
+	return !apic_read_bit(APIC_ISR, m->vec);
+}
+
+static void hv_apic_checks(void)
+{
+	u64 val;
+
+	wrmsr(HV_X64_MSR_TPR, 0x20);
+	report("synthetic TPR write reaches the APIC TPR",
+	       (apic_read(APIC_TASKPRI) & 0xff) == 0x20);
+	apic_write(APIC_TASKPRI, 0x30);
+	report("synthetic TPR reads the APIC TPR",
+	       (rdmsr(HV_X64_MSR_TPR) & 0xff) == 0x30);
+	wrmsr(HV_X64_MSR_TPR, 0);
+
+	hv_vp_assist_enable();
+	val = rdmsr(HV_X64_MSR_VP_ASSIST_PAGE);
+	report("VP assist page MSR", val ==
+	       ((u64)virt_to_phys(hv_vp_assist_page()) |
+		HV_X64_MSR_VP_ASSIST_PAGE_ENABLE));
+	hv_vp_assist_disable();
+}
+
+int main(int ac, char **av)
+{
+	bool hv_apic;
+
+	setup_vm();
+	smp_init();
+
+	handle_irq(APIC_BENCH_VEC, bench_isr);
+	handle_irq(AUTO_EOI_VEC, bench_isr);
+	irq_disable();
+
+	report("xAPIC MMIO", apic_bench("xapic", &apic_method));
+
+	hv_apic = hv_apic_access_supported();
+	if (hv_apic) {
+		printf("synthetic APIC access recommended: %s\n",
+		       hv_apic_access_recommended() ? "yes" : "no");
+		hv_apic_checks();
+
+		report("synthetic APIC MSRs", apic_bench("hv_msr", &hv_method));
+
+		hv_vp_assist_enable();
+		report("synthetic APIC MSRs with lazy EOI",
+		       apic_bench("hv_lazy_eoi", &hv_lazy_method));
+		printf("hv_lazy_eoi: %" PRIu64 "/%d EOIs skipped\n",
+		       lazy_skipped, APIC_SAMPLES + APIC_WARMUP);
+		hv_vp_assist_disable();
+	} else {
+		report_skip("synthetic APIC MSRs not available");
+	}
+
+	if (enable_x2apic())
+		report("x2APIC MSRs", apic_bench("x2apic", &apic_method));
+	else
+		report_skip("x2APIC not available");
+
+	/*
+	 * Last, so that a vector left in service by a missing auto-EOI
+	 * cannot block the other methods; it is EOIed by hand if so.
+	 */
+	if (hv_apic && synic_supported()) {
+		wrmsr(HV_X64_MSR_SCONTROL, HV_SYNIC_CONTROL_ENABLE);
+		wrmsr(HV_X64_MSR_SINT0 + AUTO_EOI_SINT,
+		      AUTO_EOI_VEC | HV_SYNIC_SINT_AUTO_EOI);
+		report("auto-EOI SINT vector",
+		       apic_bench("hv_auto_eoi", &hv_auto_method));
+		if (apic_read_bit(APIC_ISR, AUTO_EOI_VEC))
+			eoi();
+		wrmsr(HV_X64_MSR_SINT0 + AUTO_EOI_SINT,
+		      0xff | HV_SYNIC_SINT_MASKED);
+		wrmsr(HV_X64_MSR_SCONTROL, 0);
+	} else {
+		report_skip("auto-EOI needs SynIC and synthetic APIC MSRs");
+	}
+
+	return report_summary();
+}
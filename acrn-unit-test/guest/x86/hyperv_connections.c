@@ -6,6 +6,8 @@
 #include "hyperv.h"
 #include "bitops.h"
 #include "alloc_page.h"
+#include "calibrate.h"
+#include "stats.h"
 
 #define MAX_CPUS 64
 
@@ -38,57 +40,6 @@ static void sint_isr(isr_regs_t *regs)
 	atomic_inc(&hv_vcpus[smp_id()].sint_received);
 }
 
-static void *hypercall_page;
-
-static void setup_hypercall(void)
-{
-	u64 guestid = (0x8f00ull << 48);
-
-	hypercall_page = alloc_page();
-	if (!hypercall_page)
-		report_abort("failed to allocate hypercall page");
-	memset(hypercall_page, 0, PAGE_SIZE);
-
-	wrmsr(HV_X64_MSR_GUEST_OS_ID, guestid);
-
-	wrmsr(HV_X64_MSR_HYPERCALL,
-	      (u64)virt_to_phys(hypercall_page) | HV_X64_MSR_HYPERCALL_ENABLE);
-}
-
-static void teardown_hypercall(void)
-{
-	wrmsr(HV_X64_MSR_HYPERCALL, 0);
-	wrmsr(HV_X64_MSR_GUEST_OS_ID, 0);
-	free_page(hypercall_page);
-}
-
-static u64 do_hypercall(u16 code, u64 arg, bool fast)
-{
-	u64 ret;
-	u64 ctl = code;
-	if (fast)
-		ctl |= HV_HYPERCALL_FAST;
-
-	asm volatile ("call *%[hcall_page]"
-#ifdef __x86_64__
-		      "\n mov $0,%%r8"
-		      : "=a"(ret)
-		      : "c"(ctl), "d"(arg),
-#else
-		      : "=A"(ret)
-		      : "A"(ctl),
-			"b" ((u32)(arg >> 32)), "c" ((u32)arg),
-			"D"(0), "S"(0),
-#endif
-		      [hcall_page] "m" (hypercall_page)
-#ifdef __x86_64__
-		      : "r8"
-#endif
-		     );
-
-	return ret;
-}
-
 static void setup_cpu(void *ctx)
 {
 	int vcpu;
@@ -151,8 +102,7 @@ static void do_msg(void *ctx)
 
 	msg->payload[0]++;
 	atomic_set(&hv->sint_received, 0);
-	hv->hvcall_status = do_hypercall(HVCALL_POST_MESSAGE,
-					 virt_to_phys(msg), 0);
+	hv->hvcall_status = hv_do_hypercall(HVCALL_POST_MESSAGE, msg, NULL);
 	atomic_inc(&ncpus_done);
 }
 
@@ -204,8 +154,8 @@ static void do_evt(void *ctx)
 	struct hv_vcpu *hv = &hv_vcpus[vcpu];
 
 	atomic_set(&hv->sint_received, 0);
-	hv->hvcall_status = do_hypercall(HVCALL_SIGNAL_EVENT,
-					 hv->evt_conn, 1);
+	hv->hvcall_status = hv_do_fast_hypercall(HVCALL_SIGNAL_EVENT,
+					      hv->evt_conn, 0);
 	atomic_inc(&ncpus_done);
 }
 
@@ -264,7 +214,308 @@ static int run_test(int ncpus, int dst_add, ulong wait_cycles,
 	return ret;
 }
 
-#define HV_STATUS_INVALID_HYPERCALL_CODE        2
+/*
+ * Message throughput mode, "hyperv_connections.flat msg_throughput":
+ * senders post HVCALL_POST_MESSAGE as fast as they can for a fixed
+ * time, either all to vCPU 0 (fan-in) or each to the next vCPU (ring).
+ * Receivers drain their SINT slot from the interrupt handler and write
+ * EOM when msg_pending says the hypervisor has more queued. Reported are
+ * messages/sec, post-to-handler latency and how often senders got
+ * HV_STATUS_INSUFFICIENT_BUFFERS and receivers took the pending path.
+ */
+/* run time of each throughput mode run, shared with evt_throughput */
+#define BENCH_NS		1000000000ull
+#define MSG_BENCH_LAT_SAMPLES	1024
+
+struct msg_bench_cpu {
+	u64 sent;
+	u64 busy;
+	u64 errors;
+	u64 received;
+	u64 pending;
+	u64 lat[MSG_BENCH_LAT_SAMPLES];
+	struct stats_hist lat_hist;
+} __attribute__((aligned(64)));
+
+static struct msg_bench_cpu msg_bench[MAX_CPUS];
+static u64 msg_bench_all_lat[MAX_CPUS * MSG_BENCH_LAT_SAMPLES];
+static volatile u64 bench_end;
+
+static void msg_bench_isr(isr_regs_t *regs)
+{
+	u64 now = rdtsc();
+	int vcpu = smp_id();
+	struct msg_bench_cpu *b = &msg_bench[vcpu];
+	struct hv_message *msg = &hv_vcpus[vcpu].msg_page->sint_message[MSG_SINT];
+	u64 lat;
+
+	if (msg->header.message_type != MSG_TYPE)
+		return;
+
+	lat = now - msg->u.payload[1];
+	if (b->received < MSG_BENCH_LAT_SAMPLES)
+		b->lat[b->received] = lat;
+	stats_hist_add(&b->lat_hist, lat);
+	b->received++;
+
+	msg->header.message_type = HVMSG_NONE;
+	mb();
+	if (msg->header.message_flags.msg_pending) {
+		b->pending++;
+		wrmsr(HV_X64_MSR_EOM, 0);
+	}
+}
+
+static void msg_bench_send(void *ctx)
+{
+	int vcpu = smp_id();
+	struct msg_bench_cpu *b = &msg_bench[vcpu];
+	struct hv_input_post_message *msg = hv_vcpus[vcpu].post_msg;
+	u64 status;
+
+	/* keep draining our own slot while sending */
+	irq_enable();
+
+	msg->connectionid = MSG_CONN_BASE + (ulong)ctx;
+	msg->payload_size = 16;
+	while (rdtsc() < bench_end) {
+		msg->payload[0]++;
+		msg->payload[1] = rdtsc();
+		status = hv_do_hypercall(HVCALL_POST_MESSAGE, msg, NULL);
+		if (status == HV_STATUS_SUCCESS)
+			b->sent++;
+		else if (status == HV_STATUS_INSUFFICIENT_BUFFERS)
+			b->busy++;
+		else if (++b->errors > 16)
+			break;
+	}
+
+	irq_disable();
+	atomic_inc(&ncpus_done);
+}
+
+static void msg_bench_receive(void *ctx)
+{
+	irq_enable();
+	while (rdtsc() < bench_end)
+		pause();
+	irq_disable();
+	atomic_inc(&ncpus_done);
+}
+
+static void msg_bench_run(const char *name, int ncpus, bool fan_in)
+{
+	struct msg_bench_cpu *b;
+	u64 sent = 0, busy = 0, errors = 0, received = 0, pending = 0;
+	struct stats_hist hist;
+	struct stats st;
+	char buf[48];
+	u64 t0, ns;
+	int i, j, n = 0;
+
+	memset(msg_bench, 0, sizeof(msg_bench));
+	memset(&hist, 0, sizeof(hist));
+	atomic_set(&ncpus_done, 0);
+	t0 = rdtsc();
+	bench_end = t0 + ns_to_tsc(BENCH_NS);
+
+	/* vCPU 0 goes last: on_cpu_async() runs it synchronously */
+	for (i = ncpus - 1; i >= 0; i--) {
+		if (fan_in && i == 0)
+			on_cpu_async(i, msg_bench_receive, NULL);
+		else
+			on_cpu_async(i, msg_bench_send,
+				     (void *)(ulong)(fan_in ? 0 : (i + 1) % ncpus));
+	}
+	while (atomic_read(&ncpus_done) != ncpus)
+		pause();
+	ns = MAX(tsc_to_ns(rdtsc() - t0), 1);
+
+	/* let the last messages land */
+	for (i = 0; i < WAIT_CYCLES; i++)
+		pause();
+
+	for (i = 0; i < ncpus; i++) {
+		b = &msg_bench[i];
+		sent += b->sent;
+		busy += b->busy;
+		errors += b->errors;
+		received += b->received;
+		pending += b->pending;
+		for (j = 0; j < MIN(b->received, MSG_BENCH_LAT_SAMPLES); j++)
+			msg_bench_all_lat[n++] = b->lat[j];
+		for (j = 0; j < STATS_HIST_BUCKETS; j++)
+			hist.bucket[j] += b->lat_hist.bucket[j];
+	}
+
+	printf("%s: %d cpus, %" PRIu64 " sent, %" PRIu64 " received, "
+	       "%" PRIu64 " msgs/s, %" PRIu64 " busy retries, "
+	       "%" PRIu64 " pending EOMs, %" PRIu64 " errors\n",
+	       name, ncpus, sent, received,
+	       received * 1000000000 / ns, busy, pending, errors);
+
+	stats_compute(msg_bench_all_lat, n, &st);
+	snprintf(buf, sizeof(buf), "%s post-to-isr latency (tsc)", name);
+	stats_print(buf, &st);
+	stats_hist_print(name, &hist);
+
+	report("%s: messages delivered without errors", received && !errors,
+	       name);
+}
+
+static void msg_throughput(int ncpus)
+{
+	timebase_init();
+	handle_irq(MSG_VEC, msg_bench_isr);
+
+	if (ncpus > 1)
+		msg_bench_run("msg_fan_in", ncpus, true);
+	else
+		report_skip("msg_fan_in needs at least 2 vCPUs");
+	msg_bench_run("msg_ring", ncpus, false);
+
+	handle_irq(MSG_VEC, sint_isr);
+}
+
+/*
+ * Event throughput mode, "hyperv_connections.flat evt_throughput": vCPUs
+ * 1..N each loop on HVCALL_SIGNAL_EVENT for a fixed time, every one on
+ * its own connection whose flag lives in vCPU 0's event page. vCPU 0
+ * drains the flags from the SINT handler. Signals that hit a flag that
+ * is still set coalesce, so signals/events is the coalescing ratio and
+ * events/interrupt shows how much each drain batches.
+ */
+#define EVT_BENCH_CONN_BASE	0x80
+
+struct evt_bench_sender {
+	u64 signals;
+	u64 errors;
+} __attribute__((aligned(64)));
+
+static struct evt_bench_sender evt_bench_tx[MAX_CPUS];
+static u64 evt_bench_rx[MAX_CPUS];
+static u64 evt_bench_stray;
+static u64 evt_bench_irqs;
+
+static void evt_bench_flag(int flag, void *data)
+{
+	int src = flag - EVT_BENCH_CONN_BASE;
+
+	if (src > 0 && src < MAX_CPUS)
+		evt_bench_rx[src]++;
+	else
+		evt_bench_stray++;
+}
+
+static void evt_bench_drain(void)
+{
+	hv_event_flags_drain(&hv_vcpus[0].evt_page->slot[EVT_SINT],
+			     evt_bench_flag, NULL);
+}
+
+static void evt_bench_isr(isr_regs_t *regs)
+{
+	evt_bench_irqs++;
+	evt_bench_drain();
+}
+
+static void evt_bench_send(void *ctx)
+{
+	struct evt_bench_sender *tx = &evt_bench_tx[smp_id()];
+	u64 conn = EVT_BENCH_CONN_BASE + smp_id();
+	u64 status;
+
+	while (rdtsc() < bench_end) {
+		status = hv_do_fast_hypercall(HVCALL_SIGNAL_EVENT, conn, 0);
+		if (status == HV_STATUS_SUCCESS)
+			tx->signals++;
+		else if (++tx->errors > 16)
+			break;
+	}
+	atomic_inc(&ncpus_done);
+}
+
+static bool evt_bench_run(int nsenders)
+{
+	u64 signals = 0, events = 0, errors = 0, t0, ns;
+	bool ok = true;
+	int i;
+
+	memset(evt_bench_tx, 0, sizeof(evt_bench_tx));
+	memset(evt_bench_rx, 0, sizeof(evt_bench_rx));
+	evt_bench_stray = 0;
+	evt_bench_irqs = 0;
+	atomic_set(&ncpus_done, 0);
+
+	t0 = rdtsc();
+	bench_end = t0 + ns_to_tsc(BENCH_NS);
+	for (i = 1; i <= nsenders; i++)
+		on_cpu_async(i, evt_bench_send, NULL);
+
+	irq_enable();
+	while (atomic_read(&ncpus_done) != nsenders)
+		pause();
+	ns = MAX(tsc_to_ns(rdtsc() - t0), 1);
+	for (i = 0; i < WAIT_CYCLES; i++)
+		pause();
+	irq_disable();
+	evt_bench_drain();
+
+	for (i = 1; i <= nsenders; i++) {
+		signals += evt_bench_tx[i].signals;
+		errors += evt_bench_tx[i].errors;
+		events += evt_bench_rx[i];
+		if (evt_bench_tx[i].signals && !evt_bench_rx[i]) {
+			printf("evt_fan_in: no event from vCPU %d\n", i);
+			ok = false;
+		}
+	}
+
+	printf("evt_fan_in senders=%d: %" PRIu64 " signals, %" PRIu64 " events, "
+	       "%" PRIu64 " signals/s, %" PRIu64 " events/s, "
+	       "coalescing " STATS_X100_FMT ", "
+	       "%" PRIu64 " irqs, events/irq " STATS_X100_FMT ", "
+	       "%" PRIu64 " errors, %" PRIu64 " stray flags\n",
+	       nsenders, signals, events,
+	       signals * 1000000000 / ns, events * 1000000000 / ns,
+	       STATS_X100(stats_ratio_x100(signals, events)), evt_bench_irqs,
+	       STATS_X100(stats_ratio_x100(events, evt_bench_irqs)),
+	       errors, evt_bench_stray);
+
+	return ok && events && !errors && !evt_bench_stray;
+}
+
+/* 1, 2, 4, ... and finally every vCPU but the receiver */
+static int evt_next_senders(int n, int max)
+{
+	if (n == max)
+		return max + 1;
+	return n * 2 > max ? max : n * 2;
+}
+
+static void evt_throughput(int ncpus)
+{
+	bool ok = true;
+	int n;
+
+	if (ncpus < 2) {
+		report_skip("evt_fan_in needs at least 2 vCPUs");
+		return;
+	}
+
+	timebase_init();
+	handle_irq(EVT_VEC, evt_bench_isr);
+	for (n = 1; n < ncpus; n++)
+		evt_conn_create(EVT_SINT, EVT_VEC, EVT_BENCH_CONN_BASE + n);
+
+	for (n = 1; n < ncpus; n = evt_next_senders(n, ncpus - 1))
+		ok &= evt_bench_run(n);
+	report("evt_fan_in: events delivered without errors", ok);
+
+	for (n = 1; n < ncpus; n++)
+		evt_conn_destroy(EVT_SINT, EVT_BENCH_CONN_BASE + n);
+	handle_irq(EVT_VEC, sint_isr);
+}
 
 int main(int ac, char **av)
 {
@@ -284,9 +535,9 @@ int main(int ac, char **av)
 	handle_irq(MSG_VEC, sint_isr);
 	handle_irq(EVT_VEC, sint_isr);
 
-	setup_hypercall();
+	hv_setup_hypercall();
 
-	if (do_hypercall(HVCALL_SIGNAL_EVENT, 0x1234, 1) ==
+	if (hv_do_fast_hypercall(HVCALL_SIGNAL_EVENT, 0x1234, 0) ==
 	    HV_STATUS_INVALID_HYPERCALL_CODE) {
 		report_skip("Hyper-V SynIC connections are not supported");
 		goto summary;
@@ -295,6 +546,15 @@ int main(int ac, char **av)
 	for (i = 0; i < ncpus; i++)
 		on_cpu(i, setup_cpu, (void *)read_cr3());
 
+	if (ac > 1 && strcmp(av[1], "msg_throughput") == 0) {
+		msg_throughput(ncpus);
+		goto teardown;
+	}
+	if (ac > 1 && strcmp(av[1], "evt_throughput") == 0) {
+		evt_throughput(ncpus);
+		goto teardown;
+	}
+
 	ncpus_ok = run_test(ncpus, 0, WAIT_CYCLES, do_msg, msg_ok);
 	report("send message to self: %d/%d",
 	       ncpus_ok == ncpus, ncpus_ok, ncpus);
@@ -327,10 +587,11 @@ int main(int ac, char **av)
 	report("signal event already set: %d/%d",
 	       ncpus_ok == ncpus, ncpus_ok, ncpus);
 
+teardown:
 	for (i = 0; i < ncpus; i++)
 		on_cpu(i, teardown_cpu, NULL);
 
-	teardown_hypercall();
+	hv_teardown_hypercall();
 
 summary:
 	return report_summary();
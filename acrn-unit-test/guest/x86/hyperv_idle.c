@@ -0,0 +1,261 @@
+/*
+ * Wake-up latency of an idle vCPU: HV_X64_MSR_GUEST_IDLE vs HLT vs MWAIT
+ *
+ * A vCPU is parked by reading the Hyper-V guest idle MSR, by "sti; hlt"
+ * or by "sti; mwait" on a monitored line, and woken either by a fixed IPI
+ * from vCPU 0 or by its own local APIC timer. The latency is measured
+ * from the IPI send (or the programmed timer expiry) to the first
+ * instruction of the interrupt handler, in TSC cycles; TSCs are assumed
+ * to be synchronized across vCPUs. vmexit's ipi_halt times a whole IPI
+ * round trip on the sending vCPU; here the wake-up itself is isolated,
+ * and timer-driven wake-ups are covered as well.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "msr.h"
+#include "hyperv.h"
+#include "calibrate.h"
+#include "stats.h"
+
+#define IDLE_IPI_VEC 0xe4
+#define IDLE_TIMER_VEC 0xe5
+
+#define IDLE_WARMUP 8
+#define IDLE_SAMPLES 256
+/* how long the waker lets the target settle into idle, and timer delay */
+#define IDLE_SETTLE_NS 20000
+#define IDLE_TIMEOUT_NS 1000000000ull
+
+struct idle_method {
+	const char *name;
+	bool (*available)(void);
+	void (*idle)(void);
+};
+
+static volatile u64 wake_tsc;
+static volatile bool woken;
+static volatile int go_seq, ready_seq, done_seq;
+static const struct idle_method *target_method;
+
+static u64 samples[IDLE_SAMPLES];
+static struct stats_hist hist;
+
+static char monitor_line[64] __attribute__((aligned(64)));
+static bool tsc_deadline;
+
+static bool guest_idle_available(void)
+{
+	return cpuid(HYPERV_CPUID_FEATURES).d & HV_X64_GUEST_IDLE_STATE_AVAILABLE;
+}
+
+/* The read returns once an interrupt is pending; sti's shadow covers it */
+static void guest_idle(void)
+{
+	u32 a, d;
+
+	asm volatile("sti; rdmsr" : "=a"(a), "=d"(d)
+		     : "c"(HV_X64_MSR_GUEST_IDLE) : "memory");
+}
+
+static bool hlt_available(void)
+{
+	return true;
+}
+
+static bool mwait_available(void)
+{
+	return cpuid(1).c & (1 << 3);
+}
+
+static void mwait_idle(void)
+{
+	asm volatile("monitor" : : "a"(monitor_line), "c"(0), "d"(0));
+	asm volatile("sti; mwait" : : "a"(0), "c"(0) : "memory");
+}
+
+static const struct idle_method idle_methods[] = {
+	{ "guest_idle_msr", guest_idle_available, guest_idle },
+	{ "hlt", hlt_available, safe_halt },
+	{ "mwait", mwait_available, mwait_idle },
+};
+
+static void wake_isr(isr_regs_t *regs)
+{
+	wake_tsc = rdtsc();
+	woken = true;
+	eoi();
+}
+
+/*
+ * Idle until the interrupt handler ran; spurious returns go back to sleep
+ * unless the TSC has passed @deadline, which returns false.
+ */
+static bool idle_until_woken(const struct idle_method *m, u64 deadline)
+{
+	while (!woken) {
+		if (rdtsc() > deadline)
+			return false;
+		m->idle();
+		irq_disable();
+	}
+	return true;
+}
+
+static void idle_target(void *data)
+{
+	const struct idle_method *m = target_method;
+	int seq;
+
+	irq_disable();
+	for (seq = 1; seq <= IDLE_WARMUP + IDLE_SAMPLES; seq++) {
+		while (go_seq != seq)
+			pause();
+		woken = false;
+		ready_seq = seq;
+		/* vCPU 0 gives up on its own if the IPI never comes */
+		idle_until_woken(m, ~0ull);
+		done_seq = seq;
+	}
+}
+
+static void report_latency(const char *method, const char *source, int n)
+{
+	struct stats st;
+	char name[48];
+
+	stats_compute(samples, n, &st);
+	snprintf(name, sizeof(name), "%s %s", method, source);
+	stats_print(name, &st);
+	stats_hist_print(name, &hist);
+}
+
+static bool wait_seq(volatile int *v, int seq, u64 start)
+{
+	while (*v != seq) {
+		if (rdtsc() - start > ns_to_tsc(IDLE_TIMEOUT_NS))
+			return false;
+		pause();
+	}
+	return true;
+}
+
+static bool ipi_wake(const struct idle_method *m)
+{
+	u64 t, settle = ns_to_tsc(IDLE_SETTLE_NS);
+	int seq, n = 0;
+
+	memset(&hist, 0, sizeof(hist));
+	go_seq = ready_seq = done_seq = 0;
+	target_method = m;
+	on_cpu_async(1, idle_target, NULL);
+
+	for (seq = 1; seq <= IDLE_WARMUP + IDLE_SAMPLES; seq++) {
+		go_seq = seq;
+		if (!wait_seq(&ready_seq, seq, rdtsc()))
+			goto lost;
+		t = rdtsc();
+		while (rdtsc() - t < settle)
+			pause();
+
+		t = rdtsc();
+		apic_icr_write(APIC_DEST_PHYSICAL | APIC_DM_FIXED | IDLE_IPI_VEC, 1);
+		if (!wait_seq(&done_seq, seq, t))
+			goto lost;
+		if (seq <= IDLE_WARMUP)
+			continue;
+		samples[n] = wake_tsc > t ? wake_tsc - t : 0;
+		stats_hist_add(&hist, samples[n++]);
+	}
+
+	report_latency(m->name, "ipi", n);
+	return true;
+
+lost:
+	printf("%s ipi: target lost at sample %d\n", m->name, seq);
+	return false;
+}
+
+/* Program the local APIC timer @ns from now, return the expiry in TSC */
+static u64 arm_timer(u64 ns)
+{
+	u64 now = rdtsc(), expiry = now + ns_to_tsc(ns);
+
+	if (tsc_deadline)
+		wrmsr(MSR_IA32_TSCDEADLINE, expiry);
+	else
+		apic_write(APIC_TMICT, ns_to_apic(ns));
+	return expiry;
+}
+
+static bool timer_wake(const struct idle_method *m)
+{
+	u64 expiry;
+	int i, n = 0;
+
+	memset(&hist, 0, sizeof(hist));
+	if (tsc_deadline) {
+		apic_write(APIC_LVTT, APIC_LVT_TIMER_TSCDEADLINE | IDLE_TIMER_VEC);
+	} else {
+		apic_write(APIC_TDCR, 0xb);	/* divide by 1 */
+		apic_write(APIC_LVTT, APIC_LVT_TIMER_ONESHOT | IDLE_TIMER_VEC);
+	}
+
+	irq_disable();
+	for (i = 0; i < IDLE_WARMUP + IDLE_SAMPLES; i++) {
+		woken = false;
+		expiry = arm_timer(IDLE_SETTLE_NS);
+		if (!idle_until_woken(m, expiry + ns_to_tsc(IDLE_TIMEOUT_NS))) {
+			printf("%s timer: no wake-up at sample %d\n", m->name, i);
+			break;
+		}
+		if (i < IDLE_WARMUP)
+			continue;
+		samples[n] = wake_tsc > expiry ? wake_tsc - expiry : 0;
+		stats_hist_add(&hist, samples[n++]);
+	}
+	irq_enable();
+
+	apic_write(APIC_LVTT, APIC_LVT_MASKED);
+	if (i < IDLE_WARMUP + IDLE_SAMPLES)
+		return false;
+	report_latency(m->name, "timer", n);
+	return true;
+}
+
+int main(int ac, char **av)
+{
+	const struct idle_method *m;
+	bool timer;
+	int i;
+
+	setup_vm();
+	smp_init();
+	timebase_init();
+
+	handle_irq(IDLE_IPI_VEC, wake_isr);
+	handle_irq(IDLE_TIMER_VEC, wake_isr);
+
+	tsc_deadline = cpuid(1).c & (1 << 24);
+	timer = tsc_deadline || timebase.apic_hz;
+	printf("timer wake-up via %s\n", tsc_deadline ?
+	       "TSC deadline" : timer ? "APIC one-shot" : "none");
+
+	for (i = 0; i < ARRAY_SIZE(idle_methods); i++) {
+		m = &idle_methods[i];
+		if (!m->available()) {
+			report_skip("%s not available", m->name);
+			continue;
+		}
+
+		if (cpu_count() > 1)
+			report("%s woken by IPI", ipi_wake(m), m->name);
+		if (timer)
+			report("%s woken by timer", timer_wake(m), m->name);
+	}
+
+	return report_summary();
+}
@@ -0,0 +1,197 @@
+/*
+ * Multicast IPI: HvCallSendSyntheticClusterIpi(Ex) vs APIC ICR writes
+ *
+ * vCPU 0 sends one fixed-vector IPI to vCPUs 1..N, either with one ICR
+ * write per target (x2APIC if available) or with a single PV IPI
+ * hypercall naming all targets. For every N the sender-side cost (time
+ * spent issuing the IPIs) and the delivery latency (send start to the
+ * last target's handler entry) are reported. TSCs are assumed to be
+ * synchronized across vCPUs.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "atomic.h"
+#include "hyperv.h"
+#include "stats.h"
+
+#define MAX_CPUS 64
+
+#define IPI_BENCH_VECTOR 0xe1
+#define IPI_WARMUP 16
+#define IPI_SAMPLES 512
+#define IPI_TIMEOUT 1000000000ull
+
+static volatile u64 recv_tsc[MAX_CPUS];
+static atomic_t recv_count;
+
+static u64 send_samples[IPI_SAMPLES];
+static u64 deliver_samples[IPI_SAMPLES];
+
+static int ipi_ntargets;
+static u64 ipi_vp_mask;
+static u32 ipi_vps[MAX_CPUS];
+static u64 ipi_vpset_buf[2 + HV_VPSET_MAX_BANKS];
+static struct hv_vpset *ipi_vpset = (struct hv_vpset *)ipi_vpset_buf;
+static u64 ipi_status;
+static bool steal;
+
+static void ipi_isr(isr_regs_t *regs)
+{
+	recv_tsc[smp_id()] = rdtsc();
+	atomic_inc(&recv_count);
+	eoi();
+}
+
+static void ap_enable_x2apic(void *data)
+{
+	enable_x2apic();
+}
+
+static void send_icr(void)
+{
+	int cpu;
+
+	for (cpu = 1; cpu <= ipi_ntargets; cpu++)
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL |
+			       APIC_DM_FIXED | IPI_BENCH_VECTOR, cpu);
+}
+
+static void send_hcall(void)
+{
+	ipi_status = hv_send_ipi(IPI_BENCH_VECTOR, ipi_vp_mask);
+}
+
+static void send_hcall_ex(void)
+{
+	ipi_status = hv_send_ipi_ex(IPI_BENCH_VECTOR, ipi_vpset);
+}
+
+/* stats_sample() callback; delivery time goes to deliver_samples[i] */
+static bool ipi_sample(int i, u64 *send_cost, void *data)
+{
+	void (**send)(void) = data;
+	u64 t0, t1, last = 0;
+	int cpu;
+
+	atomic_set(&recv_count, 0);
+	t0 = rdtsc();
+	(*send)();
+	t1 = rdtsc();
+
+	while (atomic_read(&recv_count) < ipi_ntargets) {
+		if (rdtsc() - t0 > IPI_TIMEOUT)
+			return false;
+		pause();
+	}
+
+	for (cpu = 1; cpu <= ipi_ntargets; cpu++)
+		last = MAX(last, recv_tsc[cpu]);
+
+	*send_cost = t1 - t0;
+	if (i >= 0)
+		deliver_samples[i] = last > t0 ? last - t0 : 0;
+	return true;
+}
+
+static bool ipi_bench(const char *name, void (*send)(void))
+{
+	struct hv_steal_sample steal_start, steal_end;
+	bool ok;
+
+	ipi_status = 0;
+	if (steal)
+		hv_steal_sample(&steal_start);
+	ok = stats_sample(ipi_sample, &send, IPI_WARMUP,
+			  send_samples, IPI_SAMPLES);
+	if (steal)
+		hv_steal_sample(&steal_end);
+
+	if (ok) {
+		stats_report(send_samples, IPI_SAMPLES, NULL,
+			     "%s_send targets=%d", name, ipi_ntargets);
+		stats_report(deliver_samples, IPI_SAMPLES, NULL,
+			     "%s_deliver targets=%d", name, ipi_ntargets);
+		if (steal)
+			hv_steal_print(&steal_start, &steal_end,
+				       "%s sender targets=%d", name, ipi_ntargets);
+		return true;
+	}
+
+	printf("%s targets=%d: IPI not delivered (status 0x%" PRIx64 ")\n",
+	       name, ipi_ntargets, ipi_status);
+	return false;
+}
+
+int main(int ac, char **av)
+{
+	bool x2apic, hcall, icr_ok = true, hcall_ok = true;
+	int ncpus, cpu;
+
+	setup_vm();
+	smp_init();
+
+	ncpus = cpu_count();
+	if (ncpus > MAX_CPUS)
+		report_abort("number cpus exceeds %d", MAX_CPUS);
+	if (ncpus < 2) {
+		report_skip("need at least 2 vCPUs");
+		return report_summary();
+	}
+
+	/* The BSP goes first so that on_cpu() keeps working on the way */
+	x2apic = enable_x2apic();
+	if (x2apic)
+		for (cpu = 1; cpu < ncpus; cpu++)
+			on_cpu(cpu, ap_enable_x2apic, NULL);
+	printf("APIC mode: %s\n", x2apic ? "x2APIC" : "xAPIC");
+
+	handle_irq(IPI_BENCH_VECTOR, ipi_isr);
+	steal = hv_steal_supported();
+
+	hcall = hv_hypercall_supported() &&
+		(cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_VP_INDEX_AVAILABLE);
+	if (hcall) {
+		hv_vp_index_map_init();
+		for (cpu = 0; cpu < ncpus; cpu++)
+			if (hv_vp_index(cpu) >= 64)
+				hcall = false;
+		printf("cluster IPI recommended: %s\n",
+		       hv_cluster_ipi_recommended() ? "yes" : "no");
+	}
+	if (hcall)
+		hv_setup_hypercall();
+	else
+		report_skip("PV IPI hypercalls unusable, ICR path only");
+
+	irq_disable();
+	for (ipi_ntargets = 1; ipi_ntargets < ncpus; ipi_ntargets++) {
+		icr_ok &= ipi_bench("icr", send_icr);
+
+		if (!hcall)
+			continue;
+
+		ipi_vp_mask = 0;
+		for (cpu = 1; cpu <= ipi_ntargets; cpu++) {
+			ipi_vps[cpu - 1] = hv_vp_index(cpu);
+			ipi_vp_mask |= 1ull << ipi_vps[cpu - 1];
+		}
+		hv_vpset_encode(ipi_vpset, ipi_vps, ipi_ntargets);
+
+		hcall_ok &= ipi_bench("send_ipi", send_hcall);
+		hcall_ok &= ipi_bench("send_ipi_ex", send_hcall_ex);
+	}
+	irq_enable();
+
+	report("IPIs delivered through the ICR", icr_ok);
+	if (hcall) {
+		report("IPIs delivered through HvCallSendSyntheticClusterIpi(Ex)",
+		       hcall_ok);
+		hv_teardown_hypercall();
+	}
+
+	return report_summary();
+}
@@ -0,0 +1,141 @@
+/*
+ * Boot-time enlightenment access replay
+ *
+ * Replays a trace of CPUID, MSR, port I/O and MMIO accesses and reports
+ * the cost of every op and of the whole trace over REPLAY_RUNS runs. The
+ * default trace is the Hyper-V discovery and setup sequence a Windows
+ * guest goes through early in boot (the leaves and MSRs waag_tlfs
+ * checks), which makes a guest-OS-free proxy for WaaG boot cost that can
+ * be tracked per hypervisor build. Another trace can be passed in the
+ * REPLAY_TRACE environment variable, in the syntax described in replay.h.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "desc.h"
+#include "vm.h"
+#include "hyperv.h"
+#include "replay.h"
+#include "stats.h"
+
+#define REPLAY_MAX_OPS 256
+#define REPLAY_MAX_RUNS 64
+#define REPLAY_DEFAULT_RUNS 16
+
+/* Microsoft, Windows NT 10.0, build 19041 */
+#define WINDOWS_GUEST_OS_ID 0x0001040a00004a61ull
+
+#define CPUID(leaf)		{ .kind = REPLAY_CPUID, .addr = (leaf) }
+#define RDMSR(msr)		{ .kind = REPLAY_RDMSR, .addr = (msr) }
+#define WRMSR(msr, val)		{ .kind = REPLAY_WRMSR, .addr = (msr), .arg = (val) }
+#define WRMSR_PAGE(msr, off)	{ .kind = REPLAY_WRMSR, .addr = (msr), \
+				  .flags = REPLAY_ARG_PAGE, .arg = (off) }
+#define INB(port)		{ .kind = REPLAY_IN, .size = 1, .addr = (port) }
+#define OUTB(port, val)		{ .kind = REPLAY_OUT, .size = 1, .addr = (port), \
+				  .arg = (val) }
+#define READL(pa)		{ .kind = REPLAY_READ, .size = 4, .addr = (pa) }
+
+static const struct replay_op windows_boot_trace[] = {
+	/* hypervisor discovery */
+	CPUID(1),
+	CPUID(0x40000000),
+	CPUID(0x40000001),
+	CPUID(0x40000002),
+	CPUID(HYPERV_CPUID_FEATURES),
+	CPUID(HYPERV_CPUID_ENLIGHTMENT_INFO),
+	CPUID(0x40000005),
+	CPUID(0x40000006),
+	CPUID(0x80000007),
+
+	/* guest identity and hypercall page */
+	RDMSR(HV_X64_MSR_GUEST_OS_ID),
+	WRMSR(HV_X64_MSR_GUEST_OS_ID, WINDOWS_GUEST_OS_ID),
+	RDMSR(HV_X64_MSR_HYPERCALL),
+	WRMSR_PAGE(HV_X64_MSR_HYPERCALL, HV_X64_MSR_HYPERCALL_ENABLE),
+	RDMSR(HV_X64_MSR_HYPERCALL),
+	RDMSR(HV_X64_MSR_VP_INDEX),
+
+	/* timekeeping */
+	RDMSR(HV_X64_MSR_TSC_FREQUENCY),
+	RDMSR(HV_X64_MSR_APIC_FREQUENCY),
+	RDMSR(HV_X64_MSR_REFERENCE_TSC),
+	WRMSR_PAGE(HV_X64_MSR_REFERENCE_TSC, PAGE_SIZE | 1),
+	RDMSR(HV_X64_MSR_TIME_REF_COUNT),
+	RDMSR(HV_X64_MSR_TIME_REF_COUNT),
+
+	/* HAL platform probing: RTC through CMOS, local APIC version */
+	OUTB(0x70, 0x00),
+	INB(0x71),
+	READL(0xfee00030),
+
+	/* not part of boot: undo the setup so that every run starts clean */
+	WRMSR(HV_X64_MSR_REFERENCE_TSC, 0),
+	WRMSR(HV_X64_MSR_HYPERCALL, 0),
+	WRMSR(HV_X64_MSR_GUEST_OS_ID, 0),
+};
+
+static struct replay_op env_trace[REPLAY_MAX_OPS];
+static u64 op_cycles[REPLAY_MAX_RUNS][REPLAY_MAX_OPS];
+static bool op_faulted[REPLAY_MAX_OPS];
+static u64 run_cycles[REPLAY_MAX_RUNS];
+static u64 column[REPLAY_MAX_RUNS];
+
+int main(int ac, char **av)
+{
+	const struct replay_op *ops = windows_boot_trace;
+	int n = ARRAY_SIZE(windows_boot_trace);
+	int runs = REPLAY_DEFAULT_RUNS, faults = 0, i, r;
+	u64 median_sum = 0;
+	struct stats st;
+	char name[64];
+	char *env;
+
+	setup_vm();
+	setup_idt();
+
+	env = getenv("REPLAY_TRACE");
+	if (env) {
+		n = replay_parse(env, env_trace, REPLAY_MAX_OPS);
+		if (n <= 0) {
+			report("REPLAY_TRACE parses", false);
+			return report_summary();
+		}
+		ops = env_trace;
+	}
+
+	env = getenv("REPLAY_RUNS");
+	if (env)
+		runs = MIN(MAX(atol(env), 1), REPLAY_MAX_RUNS);
+
+	printf("replaying %s trace, %d ops, %d runs\n",
+	       ops == env_trace ? "REPLAY_TRACE" : "Windows boot", n, runs);
+
+	/* one untimed run to fault in code, data and the scratch pages */
+	replay_run(ops, n, NULL, NULL);
+	for (r = 0; r < runs; r++)
+		run_cycles[r] = replay_run(ops, n, op_cycles[r], op_faulted);
+
+	for (i = 0; i < n; i++) {
+		for (r = 0; r < runs; r++)
+			column[r] = op_cycles[r][i];
+		stats_compute(column, runs, &st);
+		median_sum += st.median;
+
+		replay_format(&ops[i], name, sizeof(name));
+		printf("op %3d %-36s median=%" PRIu64 " min=%" PRIu64
+		       " max=%" PRIu64 "%s\n", i, name, st.median, st.min,
+		       st.max, op_faulted[i] ? " faulted" : "");
+		faults += op_faulted[i];
+	}
+
+	printf("sum of op medians %" PRIu64 "\n", median_sum);
+	stats_compute(run_cycles, runs, &st);
+	stats_print("total", &st);
+
+	if (ops == env_trace)
+		printf("%d ops faulted\n", faults);
+	else
+		report("Windows boot trace replays without faults (%d faulted)",
+		       !faults, faults);
+
+	return report_summary();
+}
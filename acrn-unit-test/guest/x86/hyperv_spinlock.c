@@ -0,0 +1,162 @@
+/*
+ * Lock contention: plain test-and-set spinlock vs hv_spin_lock()
+ *
+ * Every vCPU takes one shared lock in a loop for a fixed time, holding it
+ * for a short critical section. Run with more vCPUs than host pCPUs so
+ * that lock holders get preempted: the plain lock then burns its
+ * waiters' time slices, while hv_spin_lock() tells the hypervisor via
+ * HvCallNotifyLongSpinWait once it spun past the CPUID 0x40000004.EBX
+ * threshold. Reported are acquisitions/sec, acquire latency (TSC cycles,
+ * stats and histogram over all vCPUs), the number of notifications and,
+ * with VP_RUNTIME, the time stolen from each vCPU during the run.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "atomic.h"
+#include "hyperv.h"
+#include "calibrate.h"
+#include "stats.h"
+
+#define MAX_CPUS 64
+
+#define LOCK_BENCH_NS 1000000000ull
+#define LOCK_SAMPLES 1024
+#define LOCK_HOLD_PAUSES 50
+#define LOCK_IDLE_PAUSES 100
+
+struct lock_cpu {
+	u64 acquired;
+	u64 notified;
+	u64 lat[LOCK_SAMPLES];
+	struct stats_hist hist;
+	struct hv_steal_sample steal_start;
+	struct hv_steal_sample steal_end;
+} __attribute__((aligned(64)));
+
+static struct lock_cpu lock_cpus[MAX_CPUS];
+static u64 lock_all_lat[MAX_CPUS * LOCK_SAMPLES];
+
+static struct spinlock bench_lock;
+static volatile u64 bench_counter;
+static volatile u64 bench_end;
+static atomic_t ncpus_done;
+static bool steal;
+
+static u64 plain_lock(struct spinlock *lock)
+{
+	spin_lock(lock);
+	return 0;
+}
+
+static void lock_loop(void *data)
+{
+	u64 (*lock)(struct spinlock *) = data;
+	struct lock_cpu *lc = &lock_cpus[smp_id()];
+	u64 t, lat;
+	int i;
+
+	if (steal)
+		hv_steal_sample(&lc->steal_start);
+	while (rdtsc() < bench_end) {
+		t = rdtsc();
+		lc->notified += lock(&bench_lock);
+		lat = rdtsc() - t;
+
+		bench_counter++;
+		for (i = 0; i < LOCK_HOLD_PAUSES; i++)
+			pause();
+		spin_unlock(&bench_lock);
+
+		if (lc->acquired < LOCK_SAMPLES)
+			lc->lat[lc->acquired] = lat;
+		stats_hist_add(&lc->hist, lat);
+		lc->acquired++;
+
+		for (i = 0; i < LOCK_IDLE_PAUSES; i++)
+			pause();
+	}
+	if (steal)
+		hv_steal_sample(&lc->steal_end);
+	atomic_inc(&ncpus_done);
+}
+
+static bool lock_bench(const char *name, u64 (*lock)(struct spinlock *),
+		       int ncpus)
+{
+	u64 acquired = 0, notified = 0, t0, ns;
+	struct stats_hist hist;
+	int cpu, i, n = 0;
+
+	memset(lock_cpus, 0, sizeof(lock_cpus));
+	memset(&hist, 0, sizeof(hist));
+	bench_counter = 0;
+	atomic_set(&ncpus_done, 0);
+
+	t0 = rdtsc();
+	bench_end = t0 + ns_to_tsc(LOCK_BENCH_NS);
+	for (cpu = 1; cpu < ncpus; cpu++)
+		on_cpu_async(cpu, lock_loop, lock);
+	lock_loop(lock);
+	while (atomic_read(&ncpus_done) != ncpus)
+		pause();
+	ns = MAX(tsc_to_ns(rdtsc() - t0), 1);
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		acquired += lock_cpus[cpu].acquired;
+		notified += lock_cpus[cpu].notified;
+		for (i = 0; i < MIN(lock_cpus[cpu].acquired, LOCK_SAMPLES); i++)
+			lock_all_lat[n++] = lock_cpus[cpu].lat[i];
+		for (i = 0; i < STATS_HIST_BUCKETS; i++)
+			hist.bucket[i] += lock_cpus[cpu].hist.bucket[i];
+		printf("%s cpu%d: %" PRIu64 " acquisitions\n",
+		       name, cpu, lock_cpus[cpu].acquired);
+		if (steal)
+			hv_steal_print(&lock_cpus[cpu].steal_start,
+				       &lock_cpus[cpu].steal_end,
+				       "%s cpu%d", name, cpu);
+	}
+
+	printf("%s: %d cpus, %" PRIu64 " acquisitions/s, %" PRIu64
+	       " long spin notifications\n", name, ncpus,
+	       acquired * 1000000000 / ns, notified);
+	stats_report(lock_all_lat, n, NULL, "%s acquire", name);
+	stats_hist_print(name, &hist);
+
+	/* the counter is only bumped under the lock */
+	return bench_counter == acquired;
+}
+
+int main(int ac, char **av)
+{
+	bool pv;
+	int ncpus;
+
+	setup_vm();
+	smp_init();
+	timebase_init();
+	steal = hv_steal_supported();
+
+	ncpus = cpu_count();
+	if (ncpus > MAX_CPUS)
+		report_abort("number cpus exceeds %d", MAX_CPUS);
+
+	report("plain spinlock excludes", lock_bench("plain", plain_lock, ncpus));
+
+	pv = hv_hypercall_supported();
+	if (!pv) {
+		report_skip("hypercalls not available, no long spin notification");
+		return report_summary();
+	}
+
+	hv_setup_hypercall();
+	if (hv_spin_wait_threshold() == HV_SPIN_WAIT_NEVER_NOTIFY)
+		printf("long spin wait threshold: never notify\n");
+	else
+		printf("long spin wait threshold: %u\n", hv_spin_wait_threshold());
+	report("hv_spin_lock excludes", lock_bench("hv_pv", hv_spin_lock, ncpus));
+	hv_teardown_hypercall();
+
+	return report_summary();
+}
@@ -0,0 +1,119 @@
+/*
+ * VP_RUNTIME and steal time
+ *
+ * Every vCPU spins for STEAL_INTERVALS back-to-back intervals of
+ * TIME_REF_COUNT time and samples VP_RUNTIME at each boundary. VP_RUNTIME
+ * must be monotonic and must not run ahead of the reference counter; the
+ * difference is time the vCPU wanted to run but did not, reported per
+ * interval and summarized per vCPU. Oversubscribe the host (or pin
+ * several vCPUs to one pCPU) to see it move.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "atomic.h"
+#include "hyperv.h"
+#include "stats.h"
+
+#define MAX_CPUS 64
+
+#define STEAL_INTERVALS 20
+#define STEAL_INTERVAL_100NS 500000	/* 50ms */
+/* the MSR reads are not atomic, allow 10us of overshoot per interval */
+#define STEAL_SLACK_100NS 100
+
+struct steal_cpu {
+	u64 bp[STEAL_INTERVALS];
+	struct hv_steal_sample first;
+	struct hv_steal_sample last;
+	bool monotonic;
+	bool bounded;
+} __attribute__((aligned(64)));
+
+static struct steal_cpu steal[MAX_CPUS];
+static atomic_t ncpus_done;
+
+static void steal_spin(void *data)
+{
+	struct steal_cpu *sc = &steal[smp_id()];
+	struct hv_steal_sample prev, cur;
+	u64 end;
+	int i, j;
+
+	sc->monotonic = sc->bounded = true;
+	hv_steal_sample(&sc->first);
+	prev = sc->first;
+
+	for (i = 0; i < STEAL_INTERVALS; i++) {
+		end = prev.ref + STEAL_INTERVAL_100NS;
+		/* keep exits rare: they are charged to VP_RUNTIME too */
+		do {
+			for (j = 0; j < 1000; j++)
+				pause();
+		} while (rdmsr(HV_X64_MSR_TIME_REF_COUNT) < end);
+
+		hv_steal_sample(&cur);
+		if (cur.runtime < prev.runtime || cur.ref < prev.ref)
+			sc->monotonic = false;
+		if (cur.runtime - prev.runtime >
+		    cur.ref - prev.ref + STEAL_SLACK_100NS)
+			sc->bounded = false;
+		sc->bp[i] = hv_steal_bp(&prev, &cur);
+		prev = cur;
+	}
+
+	sc->last = prev;
+	atomic_inc(&ncpus_done);
+}
+
+int main(int ac, char **av)
+{
+	bool monotonic = true, bounded = true, ran = true;
+	u64 samples[STEAL_INTERVALS];
+	int ncpus, cpu, i;
+
+	setup_vm();
+	smp_init();
+
+	if (!hv_steal_supported()) {
+		report_skip("VP_RUNTIME or TIME_REF_COUNT not available");
+		return report_summary();
+	}
+
+	ncpus = cpu_count();
+	if (ncpus > MAX_CPUS)
+		report_abort("number cpus exceeds %d", MAX_CPUS);
+
+	atomic_set(&ncpus_done, 0);
+	for (cpu = 1; cpu < ncpus; cpu++)
+		on_cpu_async(cpu, steal_spin, NULL);
+	steal_spin(NULL);
+	while (atomic_read(&ncpus_done) != ncpus)
+		pause();
+
+	for (i = 0; i < STEAL_INTERVALS; i++) {
+		printf("interval %2d steal%%:", i);
+		for (cpu = 0; cpu < ncpus; cpu++)
+			printf(" " STATS_X100_FMT, STATS_X100(steal[cpu].bp[i]));
+		printf("\n");
+	}
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		memcpy(samples, steal[cpu].bp, sizeof(samples));
+		stats_report(samples, STEAL_INTERVALS, NULL, "cpu%d steal_bp", cpu);
+
+		hv_steal_print(&steal[cpu].first, &steal[cpu].last,
+			       "cpu%d total", cpu);
+
+		monotonic &= steal[cpu].monotonic;
+		bounded &= steal[cpu].bounded;
+		ran &= steal[cpu].last.runtime > steal[cpu].first.runtime;
+	}
+
+	report("VP_RUNTIME advances while spinning", ran);
+	report("VP_RUNTIME and TIME_REF_COUNT are monotonic", monotonic);
+	report("VP_RUNTIME does not outrun TIME_REF_COUNT", bounded);
+
+	return report_summary();
+}
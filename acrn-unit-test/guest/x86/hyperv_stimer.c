@@ -10,6 +10,8 @@
 #include "hyperv.h"
 #include "asm/barrier.h"
 #include "alloc_page.h"
+#include "stats.h"
+#include "calibrate.h"
 
 #define MAX_CPUS 4
 
@@ -350,6 +352,209 @@ static void stimer_test_all(void)
     on_cpus(stimer_test_cleanup, NULL);
 }
 
+/*
+ * Latency mode, "hyperv_stimer.flat latency": stimer0 on the BSP is armed
+ * one-shot or periodic at 100us..10ms, delivering either a SIMP message on
+ * SINT1 or (if offered) a direct-mode APIC vector. For every expiration
+ * the hypervisor's delivery time minus expiration time (message mode only)
+ * and ISR entry minus expiration time are collected, all in 100ns units.
+ * ISR entry is stamped with TIME_REF_COUNT, so it includes one MSR read.
+ * A run fails if its samples do not arrive within four times the expected
+ * time plus LAT_SLACK, measured on the TSC.
+ */
+#define LAT_DIRECT_VEC 0xF3
+#define LAT_MAX_SAMPLES 512
+#define LAT_SLACK 10000000	/* 1s in 100ns units */
+
+static const u64 lat_periods[] = { 1000, 10000, 100000 };
+static const int lat_nr_samples[] = { 500, 200, 50 };
+
+struct stimer_lat {
+    struct stimer *timer;
+    bool direct;
+    bool periodic;
+    u64 period;
+    u64 next_exp;
+    int want;
+    volatile int n;
+    u64 deliver[LAT_MAX_SAMPLES];
+    u64 isr[LAT_MAX_SAMPLES];
+    struct stats_hist deliver_hist;
+    struct stats_hist isr_hist;
+};
+
+static struct stimer_lat g_lat;
+
+static void stimer_lat_record(u64 deliver, u64 isr)
+{
+    struct stimer_lat *lat = &g_lat;
+
+    if (lat->n >= lat->want)
+        return;
+
+    lat->deliver[lat->n] = deliver;
+    lat->isr[lat->n] = isr;
+    stats_hist_add(&lat->deliver_hist, deliver);
+    stats_hist_add(&lat->isr_hist, isr);
+    if (++lat->n == lat->want)
+        stimer_shutdown(lat->timer);
+}
+
+static void stimer_lat_msg_isr(isr_regs_t *regs)
+{
+    u64 now = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+    struct hv_message_page *msg_page = g_synic_vcpu[smp_id()].msg_page;
+    struct hv_message *msg = &msg_page->sint_message[SINT1_NUM];
+    struct hv_timer_message_payload *payload =
+                        (struct hv_timer_message_payload *)msg->u.payload;
+
+    if (msg->header.message_type == HVMSG_TIMER_EXPIRED) {
+        stimer_lat_record(payload->delivery_time - payload->expiration_time,
+                          now - payload->expiration_time);
+        msg->header.message_type = HVMSG_NONE;
+        mb();
+        if (msg->header.message_flags.msg_pending)
+            wrmsr(HV_X64_MSR_EOM, 0);
+    }
+    eoi();
+}
+
+/* no message in direct mode, the expiration time is tracked here */
+static void stimer_lat_direct_isr(isr_regs_t *regs)
+{
+    u64 now = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+    struct stimer_lat *lat = &g_lat;
+
+    stimer_lat_record(0, now - lat->next_exp);
+    if (lat->periodic) {
+        lat->next_exp += lat->period;
+        /* missed periods are not delivered, skip to the next one due */
+        if (lat->next_exp <= now)
+            lat->next_exp += ((now - lat->next_exp) / lat->period + 1) *
+                             lat->period;
+    }
+    eoi();
+}
+
+static void stimer_lat_arm(struct stimer_lat *lat)
+{
+    u64 config, count, now;
+
+    config = HV_STIMER_ENABLE;
+    if (lat->periodic)
+        config |= HV_STIMER_PERIODIC;
+    if (lat->direct)
+        config |= HV_STIMER_DIRECT_MODE | HV_STIMER_APIC_VECTOR(LAT_DIRECT_VEC);
+    else
+        config |= (u64)SINT1_NUM << 16;
+
+    now = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+    count = lat->periodic ? lat->period : now + lat->period;
+    lat->next_exp = now + lat->period;
+
+    wrmsr(HV_X64_MSR_STIMER0_COUNT + lat->timer->index*2, count);
+    wrmsr(HV_X64_MSR_STIMER0_CONFIG + lat->timer->index*2, config);
+}
+
+/* wait for more than @n samples, false once the TSC passes @deadline */
+static bool stimer_lat_wait(struct stimer_lat *lat, int n, u64 deadline)
+{
+    while (lat->n <= n) {
+        if (rdtsc() > deadline)
+            return false;
+        pause();
+    }
+    return true;
+}
+
+static bool stimer_lat_run(struct stimer *timer, bool direct, bool periodic,
+                           u64 period, int want)
+{
+    struct stimer_lat *lat = &g_lat;
+    bool ok = true;
+    u64 deadline;
+    char name[64];
+    struct stats st;
+    int n;
+
+    memset(lat, 0, sizeof(*lat));
+    lat->timer = timer;
+    lat->direct = direct;
+    lat->periodic = periodic;
+    lat->period = period;
+    lat->want = MIN(want, LAT_MAX_SAMPLES);
+    deadline = rdtsc() + ref_ticks_to_tsc(4 * lat->want * period + LAT_SLACK);
+
+    if (periodic) {
+        stimer_lat_arm(lat);
+        ok = stimer_lat_wait(lat, lat->want - 1, deadline);
+    } else {
+        while (ok && lat->n < lat->want) {
+            n = lat->n;
+            stimer_lat_arm(lat);
+            ok = stimer_lat_wait(lat, n, deadline);
+        }
+    }
+    stimer_shutdown(timer);
+
+    snprintf(name, sizeof(name), "stimer_%s_%s_%" PRIu64 "us",
+             direct ? "direct" : "msg", periodic ? "periodic" : "oneshot",
+             period / 10);
+    if (!ok) {
+        printf("%s: timed out after %d of %d expirations\n",
+               name, lat->n, lat->want);
+        return false;
+    }
+    if (!direct) {
+        stats_compute(lat->deliver, lat->n, &st);
+        printf("%s delivery-expiration (100ns): ", name);
+        stats_print("", &st);
+        stats_hist_print(name, &lat->deliver_hist);
+    }
+    stats_compute(lat->isr, lat->n, &st);
+    printf("%s isr-expiration (100ns): ", name);
+    stats_print("", &st);
+    stats_hist_print(name, &lat->isr_hist);
+    return true;
+}
+
+static void stimer_latency_all(void)
+{
+    bool direct_ok = cpuid(HYPERV_CPUID_FEATURES).d &
+                     HV_STIMER_DIRECT_MODE_AVAILABLE;
+    struct stimer *timer;
+    int direct, periodic, i;
+    bool ok = true;
+
+    setup_vm();
+    smp_init();
+    enable_apic();
+    timebase_init();
+    if (!timebase.tsc_hz) {
+        report_skip("no TSC frequency for the latency timeouts");
+        return;
+    }
+
+    handle_irq(SINT1_VEC, stimer_lat_msg_isr);
+    handle_irq(LAT_DIRECT_VEC, stimer_lat_direct_isr);
+
+    stimer_test_prepare((void *)read_cr3());
+    timer = &g_synic_vcpu[smp_id()].timer[0];
+    if (!direct_ok)
+        report_skip("direct-mode synthetic timers are not supported");
+
+    irq_enable();
+    for (direct = 0; direct <= direct_ok; direct++)
+        for (periodic = 0; periodic <= 1; periodic++)
+            for (i = 0; i < ARRAY_SIZE(lat_periods); i++)
+                ok &= stimer_lat_run(timer, direct, periodic,
+                                     lat_periods[i], lat_nr_samples[i]);
+    irq_disable();
+
+    stimer_test_cleanup(NULL);
+    report("Hyper-V SynIC timer latency collected", ok);
+}
+
 int main(int ac, char **av)
 {
 
@@ -368,7 +573,10 @@ int main(int ac, char **av)
         goto done;
     }
 
-    stimer_test_all();
+    if (ac > 1 && strcmp(av[1], "latency") == 0)
+        stimer_latency_all();
+    else
+        stimer_test_all();
 done:
     return report_summary();
 }
@@ -0,0 +1,189 @@
+/*
+ * Remote TLB flush: HvCallFlushVirtualAddressList vs IPI shootdown
+ *
+ * A range of pages is invalidated on the first N vCPUs either by one
+ * (rep) hypercall naming those vCPUs in the processor mask, or natively
+ * by IPIing every remote vCPU to run invlpg over the range while the
+ * initiator does the same locally and then waits for the others. The
+ * cost of both is reported for each vCPU count and page count, which
+ * shows where HV_X64_REMOTE_TLB_FLUSH_RECOMMENDED in CPUID 0x40000004
+ * starts to pay off.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "smp.h"
+#include "hyperv.h"
+#include "alloc_page.h"
+#include "stats.h"
+
+#define MAX_CPUS 64
+
+#define FLUSH_MAX_ORDER 8
+#define FLUSH_MAX_PAGES (1 << FLUSH_MAX_ORDER)
+#define FLUSH_WARMUP 16
+#define FLUSH_SAMPLES 256
+
+static const int flush_pages[] = { 1, 8, 32, FLUSH_MAX_PAGES };
+
+static u64 samples[FLUSH_SAMPLES];
+
+static char *flush_base;
+static int flush_npages;
+static int flush_ncpus;
+static u64 flush_status;
+
+static void flush_local(void *data)
+{
+	int i;
+
+	for (i = 0; i < flush_npages; i++)
+		invlpg(flush_base + i * PAGE_SIZE);
+}
+
+static void flush_ipi(void)
+{
+	int cpu;
+
+	for (cpu = 1; cpu < flush_ncpus; cpu++)
+		on_cpu_async(cpu, flush_local, NULL);
+	flush_local(NULL);
+
+	while (cpus_active() > 1)
+		pause();
+}
+
+/* The input page already holds the list, only the hypercall is timed */
+static void flush_hcall(void)
+{
+	flush_status = hv_do_rep_hypercall(HVCALL_FLUSH_VIRTUAL_ADDRESS_LIST,
+					   flush_npages, 0,
+					   hv_hypercall_input_page(), NULL,
+					   NULL);
+}
+
+static void prepare_hcall_input(void)
+{
+	struct hv_tlb_flush *flush = hv_hypercall_input_page();
+	int cpu, i;
+
+	flush->address_space = read_cr3();
+	flush->flags = 0;
+	flush->processor_mask = 0;
+	for (cpu = 0; cpu < flush_ncpus; cpu++)
+		flush->processor_mask |= 1ull << hv_vp_index(cpu);
+	for (i = 0; i < flush_npages; i++)
+		flush->gva_list[i] = (u64)(uintptr_t)(flush_base + i * PAGE_SIZE);
+}
+
+static bool steal;
+static struct hv_steal_sample steal_start, steal_end;
+
+static bool flush_sample(int i, u64 *out, void *data)
+{
+	void (**func)(void) = data;
+	u64 t;
+
+	t = rdtsc();
+	(*func)();
+	*out = rdtsc() - t;
+	return true;
+}
+
+static void measure(void (*func)(void))
+{
+	if (steal)
+		hv_steal_sample(&steal_start);
+	stats_sample(flush_sample, &func, FLUSH_WARMUP, samples, FLUSH_SAMPLES);
+	if (steal)
+		hv_steal_sample(&steal_end);
+}
+
+static int next_ncpus(int n, int ncpus)
+{
+	if (n == ncpus)
+		return ncpus + 1;
+	return n * 2 > ncpus ? ncpus : n * 2;
+}
+
+int main(int ac, char **av)
+{
+	struct stats ipi_st, hcall_st;
+	bool hcall, ok = true;
+	int ncpus, cpu, i;
+
+	setup_vm();
+	smp_init();
+
+	ncpus = cpu_count();
+	if (ncpus > MAX_CPUS)
+		report_abort("number cpus exceeds %d", MAX_CPUS);
+
+	flush_base = alloc_pages(FLUSH_MAX_ORDER);
+	if (!flush_base)
+		report_abort("failed to allocate %d pages", FLUSH_MAX_PAGES);
+	memset(flush_base, 0, FLUSH_MAX_PAGES * PAGE_SIZE);
+
+	hcall = hv_hypercall_supported();
+	steal = hv_steal_supported();
+	printf("remote TLB flush recommended: %s\n",
+	       hv_remote_tlb_flush_recommended() ? "yes" : "no");
+
+	if (hcall) {
+		hv_vp_index_map_init();
+		for (cpu = 0; cpu < ncpus; cpu++)
+			if (hv_vp_index(cpu) >= 64)
+				hcall = false;
+	}
+	if (hcall)
+		hv_setup_hypercall();
+	else
+		report_skip("flush hypercall unusable, IPI shootdown only");
+
+	irq_disable();
+	for (flush_ncpus = 1; flush_ncpus <= ncpus;
+	     flush_ncpus = next_ncpus(flush_ncpus, ncpus)) {
+		for (i = 0; i < ARRAY_SIZE(flush_pages); i++) {
+			flush_npages = flush_pages[i];
+
+			measure(flush_ipi);
+			stats_report(samples, FLUSH_SAMPLES, &ipi_st,
+				     "ipi cpus=%d pages=%d", flush_ncpus, flush_npages);
+			if (steal)
+				hv_steal_print(&steal_start, &steal_end,
+					       "ipi cpus=%d pages=%d",
+					       flush_ncpus, flush_npages);
+
+			if (!hcall)
+				continue;
+
+			prepare_hcall_input();
+			measure(flush_hcall);
+			if (hv_result(flush_status) != HV_STATUS_SUCCESS) {
+				printf("flush list cpus=%d pages=%d: status 0x%" PRIx64 "\n",
+				       flush_ncpus, flush_npages, flush_status);
+				ok = false;
+				continue;
+			}
+			stats_report(samples, FLUSH_SAMPLES, &hcall_st,
+				     "hcall cpus=%d pages=%d", flush_ncpus, flush_npages);
+			if (steal)
+				hv_steal_print(&steal_start, &steal_end,
+					       "hcall cpus=%d pages=%d",
+					       flush_ncpus, flush_npages);
+
+			printf("hcall/ipi median ratio cpus=%d pages=%d " STATS_X100_FMT "\n",
+			       flush_ncpus, flush_npages,
+			       STATS_X100(stats_ratio_x100(hcall_st.median, ipi_st.median)));
+		}
+	}
+	irq_enable();
+
+	if (hcall) {
+		report("flush virtual address list hypercall", ok);
+		hv_teardown_hypercall();
+	}
+
+	free_pages(flush_base, FLUSH_MAX_PAGES * PAGE_SIZE);
+	return report_summary();
+}
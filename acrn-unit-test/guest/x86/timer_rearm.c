@@ -0,0 +1,255 @@
+/*
+ * Timer programming cost: LAPIC one-shot, TSC deadline, Hyper-V stimer
+ *
+ * A tickless guest re-arms its timer on nearly every idle entry and exit,
+ * often cancelling it again before it fires. This measures exactly that,
+ * without delivery: "arm" moves an armed timer to another far-future
+ * expiry, "arm_cancel" arms and immediately disarms it. Sources are
+ * APIC_TMICT, MSR_IA32_TSCDEADLINE and Hyper-V stimer 0, the latter
+ * either through COUNT alone (auto-enable, as Linux and Windows do) or
+ * through COUNT and CONFIG. Everything runs in xAPIC and then in x2APIC
+ * mode. vmexit's tscdeadline tests time arming plus delivery instead.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "msr.h"
+#include "vm.h"
+#include "apic.h"
+#include "isr.h"
+#include "alloc_page.h"
+#include "hyperv.h"
+#include "stats.h"
+
+#define TIMER_VEC 0xe6
+#define STIMER_SINT 2
+
+#define REARM_WARMUP 16
+#define REARM_SAMPLES 1024
+
+/* far enough that nothing fires while measuring */
+#define FAR_TSC (1ull << 36)
+#define FAR_APIC (1u << 31)
+#define FAR_100NS 100000000ull
+
+struct timer_source {
+	const char *name;
+	bool (*available)(void);
+	void (*setup)(void);
+	void (*arm)(u64 i);
+	void (*cancel)(void);
+	void (*teardown)(void);
+};
+
+static u64 samples[REARM_SAMPLES];
+static volatile int fired;
+static u64 tsc_base, ref_base;
+static u64 stimer_config;
+static void *simp_page;
+
+static void timer_isr(isr_regs_t *regs)
+{
+	fired++;
+	eoi();
+}
+
+static bool always(void)
+{
+	return true;
+}
+
+static void lapic_setup(void)
+{
+	apic_write(APIC_TDCR, 0xb);	/* divide by 1 */
+	apic_write(APIC_LVTT, APIC_LVT_TIMER_ONESHOT | TIMER_VEC);
+}
+
+static void lapic_arm(u64 i)
+{
+	apic_write(APIC_TMICT, FAR_APIC - (u32)i);
+}
+
+static void lapic_cancel(void)
+{
+	apic_write(APIC_TMICT, 0);
+}
+
+static void lapic_teardown(void)
+{
+	apic_write(APIC_TMICT, 0);
+	apic_write(APIC_LVTT, APIC_LVT_MASKED);
+}
+
+static bool tsc_deadline_available(void)
+{
+	return cpuid(1).c & (1 << 24);
+}
+
+static void tsc_deadline_setup(void)
+{
+	apic_write(APIC_LVTT, APIC_LVT_TIMER_TSCDEADLINE | TIMER_VEC);
+	tsc_base = rdtsc() + FAR_TSC;
+}
+
+static void tsc_deadline_arm(u64 i)
+{
+	wrmsr(MSR_IA32_TSCDEADLINE, tsc_base + i);
+}
+
+static void tsc_deadline_cancel(void)
+{
+	wrmsr(MSR_IA32_TSCDEADLINE, 0);
+}
+
+static void tsc_deadline_teardown(void)
+{
+	wrmsr(MSR_IA32_TSCDEADLINE, 0);
+	apic_write(APIC_LVTT, APIC_LVT_MASKED);
+}
+
+static bool stimer_available(void)
+{
+	return stimer_supported() && hv_time_ref_counter_supported();
+}
+
+/*
+ * Direct mode needs no SynIC message page; otherwise the stimer posts to
+ * STIMER_SINT, which must be unmasked for KVM to accept the enable bit.
+ */
+static void stimer_setup_config(u64 extra)
+{
+	if (cpuid(HYPERV_CPUID_FEATURES).d & HV_STIMER_DIRECT_MODE_AVAILABLE) {
+		stimer_config = HV_STIMER_DIRECT_MODE |
+			HV_STIMER_APIC_VECTOR(TIMER_VEC);
+	} else {
+		simp_page = alloc_page();
+		memset(simp_page, 0, PAGE_SIZE);
+		wrmsr(HV_X64_MSR_SIMP, (u64)virt_to_phys(simp_page) |
+		      HV_SYNIC_SIMP_ENABLE);
+		wrmsr(HV_X64_MSR_SCONTROL, HV_SYNIC_CONTROL_ENABLE);
+		wrmsr(HV_X64_MSR_SINT0 + STIMER_SINT, TIMER_VEC);
+		stimer_config = (u64)STIMER_SINT << 16;
+	}
+	stimer_config |= HV_STIMER_ENABLE | extra;
+	ref_base = rdmsr(HV_X64_MSR_TIME_REF_COUNT) + FAR_100NS;
+}
+
+static void stimer_auto_setup(void)
+{
+	stimer_setup_config(HV_STIMER_AUTOENABLE);
+	wrmsr(HV_X64_MSR_STIMER0_CONFIG, stimer_config);
+}
+
+static void stimer_count_arm(u64 i)
+{
+	wrmsr(HV_X64_MSR_STIMER0_COUNT, ref_base + i);
+}
+
+static void stimer_count_cancel(void)
+{
+	wrmsr(HV_X64_MSR_STIMER0_COUNT, 0);
+}
+
+static void stimer_config_setup(void)
+{
+	stimer_setup_config(0);
+}
+
+static void stimer_config_arm(u64 i)
+{
+	wrmsr(HV_X64_MSR_STIMER0_COUNT, ref_base + i);
+	wrmsr(HV_X64_MSR_STIMER0_CONFIG, stimer_config);
+}
+
+static void stimer_config_cancel(void)
+{
+	wrmsr(HV_X64_MSR_STIMER0_CONFIG, 0);
+}
+
+static void stimer_teardown(void)
+{
+	wrmsr(HV_X64_MSR_STIMER0_CONFIG, 0);
+	wrmsr(HV_X64_MSR_STIMER0_COUNT, 0);
+	if (simp_page) {
+		wrmsr(HV_X64_MSR_SINT0 + STIMER_SINT,
+		      0xff | HV_SYNIC_SINT_MASKED);
+		wrmsr(HV_X64_MSR_SCONTROL, 0);
+		wrmsr(HV_X64_MSR_SIMP, 0);
+		free_page(simp_page);
+		simp_page = NULL;
+	}
+}
+
+static const struct timer_source sources[] = {
+	{ "lapic_oneshot", always, lapic_setup, lapic_arm, lapic_cancel,
+	  lapic_teardown },
+	{ "tsc_deadline", tsc_deadline_available, tsc_deadline_setup,
+	  tsc_deadline_arm, tsc_deadline_cancel, tsc_deadline_teardown },
+	{ "hv_stimer_count", stimer_available, stimer_auto_setup,
+	  stimer_count_arm, stimer_count_cancel, stimer_teardown },
+	{ "hv_stimer_config", stimer_available, stimer_config_setup,
+	  stimer_config_arm, stimer_config_cancel, stimer_teardown },
+};
+
+static void measure(const char *mode, const struct timer_source *src,
+		    bool cancel)
+{
+	struct stats st;
+	char name[48];
+	u64 t;
+	int i;
+
+	for (i = 0; i < REARM_WARMUP + REARM_SAMPLES; i++) {
+		t = rdtsc();
+		src->arm(i);
+		if (cancel)
+			src->cancel();
+		t = rdtsc() - t;
+		if (i >= REARM_WARMUP)
+			samples[i - REARM_WARMUP] = t;
+	}
+
+	stats_compute(samples, REARM_SAMPLES, &st);
+	snprintf(name, sizeof(name), "%s %s %s", mode, src->name,
+		 cancel ? "arm_cancel" : "arm");
+	stats_print(name, &st);
+}
+
+static void run_sources(const char *mode)
+{
+	const struct timer_source *src;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sources); i++) {
+		src = &sources[i];
+		if (!src->available()) {
+			printf("%s %s: not available\n", mode, src->name);
+			continue;
+		}
+		src->setup();
+		measure(mode, src, false);
+		measure(mode, src, true);
+		src->teardown();
+	}
+}
+
+int main(int ac, char **av)
+{
+	int i;
+
+	setup_vm();
+	handle_irq(TIMER_VEC, timer_isr);
+	irq_disable();
+
+	run_sources("xapic");
+	if (enable_x2apic())
+		run_sources("x2apic");
+	else
+		report_skip("x2APIC not available");
+
+	/* anything latched while measuring is delivered now */
+	irq_enable();
+	for (i = 0; i < 100000; i++)
+		pause();
+	report("no timer fired while re-arming (%d)", !fired, fired);
+	return report_summary();
+}
@@ -8,6 +8,8 @@
 #include "x86/acpi.h"
 #include "x86/apic.h"
 #include "x86/isr.h"
+#include "x86/hyperv.h"
+#include "stats.h"
 
 #define IPI_TEST_VECTOR	0xb0
 
@@ -17,11 +19,23 @@ struct test {
 	int (*valid)(void);
 	int parallel;
 	bool (*next)(struct test *);
+	u64 median;		/* of the last run, for the device matrix */
 };
 
-#define GOAL (1ull << 30)
+/*
+ * Every call is timed on its own, after VMEXIT_WARMUP untimed ones.
+ * Samples are taken VMEXIT_CHUNK at a time until the 95% confidence
+ * interval of the mean is within VMEXIT_CI_PERMILLE of it, or the buffer
+ * is full; the tail is what a single mean over 2^30 cycles used to hide.
+ */
+#define VMEXIT_WARMUP 64
+#define VMEXIT_CHUNK 1024
+#define VMEXIT_MIN_SAMPLES (4 * VMEXIT_CHUNK)
+#define VMEXIT_MAX_SAMPLES (64 * VMEXIT_CHUNK)
+#define VMEXIT_CI_PERMILLE 10
 
 static int nr_cpus;
+static int run_cpus;	/* CPUs taking part in the current run */
 
 static void cpuid_test(void)
 {
@@ -235,7 +249,7 @@ static void ple_round_robin(void)
 
 	p->n2 = p->n1;
 	you = me + 1;
-	if (you == nr_cpus)
+	if (you == run_cpus)
 		you = 0;
 	++counters[you].n1;
 }
@@ -255,6 +269,130 @@ static void wr_kernel_gs_base(void)
 	wrmsr(MSR_KERNEL_GS_BASE, 0x0);
 }
 
+/*
+ * Hyper-V interfaces, all gated on the CPUID.1:ECX hypervisor bit plus
+ * the feature bit of the MSR involved. VP_INDEX is read-only per the
+ * TLFS, so only GUEST_OS_ID has a write case; it rewrites the value
+ * hv_setup_hypercall() stored, which keeps the hypercall page enabled.
+ */
+static int is_hyperv(void)
+{
+	return cpuid(1).c & (1u << 31);
+}
+
+static int has_hv_time_ref(void)
+{
+	return is_hyperv() && hv_time_ref_counter_supported();
+}
+
+static int has_hv_vp_index(void)
+{
+	return is_hyperv() &&
+	       (cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_VP_INDEX_AVAILABLE);
+}
+
+static int has_hv_hypercall(void)
+{
+	return is_hyperv() && hv_hypercall_supported();
+}
+
+static void hv_rd_time_ref_count(void)
+{
+	rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+}
+
+static void hv_rd_vp_index(void)
+{
+	rdmsr(HV_X64_MSR_VP_INDEX);
+}
+
+static void hv_rd_guest_os_id(void)
+{
+	rdmsr(HV_X64_MSR_GUEST_OS_ID);
+}
+
+static void hv_wr_guest_os_id(void)
+{
+	wrmsr(HV_X64_MSR_GUEST_OS_ID, HV_TEST_GUEST_OS_ID);
+}
+
+/* Code 0 is reserved: the call fails with HV_STATUS_INVALID_HYPERCALL_CODE */
+static void hv_hypercall_invalid(void)
+{
+	hv_hypercall(HV_HYPERCALL_FAST, 0, 0);
+}
+
+#define HV_CPUID_TEST(leaf)				\
+static void hv_cpuid_##leaf(void)			\
+{							\
+	cpuid(leaf);					\
+}
+
+HV_CPUID_TEST(0x40000000)
+HV_CPUID_TEST(0x40000001)
+HV_CPUID_TEST(0x40000002)
+HV_CPUID_TEST(0x40000003)
+HV_CPUID_TEST(0x40000004)
+HV_CPUID_TEST(0x40000005)
+HV_CPUID_TEST(0x40000006)
+
+/*
+ * Emulated platform devices, one case per device and access width, named
+ * dev_<device>_<bits> and printed as a matrix at the end. Only harmless
+ * accesses are made: CMOS, PIT and PCI config cases select a register
+ * and then read it at the given width, the RTC is never written, and
+ * the xAPIC and IOAPIC are only accessed 32 bits wide as they require.
+ * The POST port and UART LSR are only accessed 8 bits wide: wider POST
+ * writes spill into the DMA page registers at 0x81-0x83, and a wider
+ * LSR read also reads the MSR, clearing its delta bits.
+ */
+static inline void pio_read(int bits, u16 port)
+{
+	if (bits == 8)
+		inb(port);
+	else if (bits == 16)
+		inw(port);
+	else
+		inl(port);
+}
+
+static int is_xapic(void)
+{
+	return !is_x2apic();
+}
+
+#define DEV_TEST(dev, bits, body)			\
+static void dev_##dev##_##bits(void)			\
+{							\
+	body;						\
+}
+
+/* RTC seconds register through the index/data pair */
+#define DEV_CMOS(bits)	DEV_TEST(cmos, bits, outb(0x00, 0x70); pio_read(bits, 0x71))
+/* latch and read PIT counter 0 */
+#define DEV_PIT(bits)	DEV_TEST(pit, bits, outb(0x00, 0x43); pio_read(bits, 0x40))
+/* vendor ID of 00:00.0 through configuration mechanism #1 */
+#define DEV_PCI(bits)	DEV_TEST(pci_cfg, bits, outl(0x80000000, 0xcf8); \
+				 pio_read(bits, 0xcfc))
+
+DEV_CMOS(8)
+DEV_CMOS(16)
+DEV_CMOS(32)
+DEV_PIT(8)
+DEV_PIT(16)
+DEV_PIT(32)
+DEV_PCI(8)
+DEV_PCI(16)
+DEV_PCI(32)
+/* POST diagnostic port */
+DEV_TEST(post, 8, outb(0, 0x80))
+/* COM1 line status register */
+DEV_TEST(uart_lsr, 8, inb(0x3fd))
+DEV_TEST(xapic_read, 32, apic_read(APIC_LVR))
+DEV_TEST(xapic_write, 32, apic_write(APIC_TASKPRI, 0))
+/* version register through the index/data window */
+DEV_TEST(ioapic, 32, ioapic_read_reg(0x01))
+
 static struct pci_test {
 	unsigned iobar;
 	unsigned ioport;
@@ -470,28 +608,255 @@ static struct test tests[] = {
 	{ wr_ibpb_msr, "wr_ibpb_msr", has_ibpb, .parallel = 1 },
 	{ wr_tsc_adjust_msr, "wr_tsc_adjust_msr", .parallel = 1 },
 	{ rd_tsc_adjust_msr, "rd_tsc_adjust_msr", .parallel = 1 },
+	{ hv_cpuid_0x40000000, "hv_cpuid_40000000", is_hyperv, .parallel = 1 },
+	{ hv_cpuid_0x40000001, "hv_cpuid_40000001", is_hyperv, .parallel = 1 },
+	{ hv_cpuid_0x40000002, "hv_cpuid_40000002", is_hyperv, .parallel = 1 },
+	{ hv_cpuid_0x40000003, "hv_cpuid_40000003", is_hyperv, .parallel = 1 },
+	{ hv_cpuid_0x40000004, "hv_cpuid_40000004", is_hyperv, .parallel = 1 },
+	{ hv_cpuid_0x40000005, "hv_cpuid_40000005", is_hyperv, .parallel = 1 },
+	{ hv_cpuid_0x40000006, "hv_cpuid_40000006", is_hyperv, .parallel = 1 },
+	{ hv_rd_time_ref_count, "hv_rd_time_ref_count", has_hv_time_ref, .parallel = 1 },
+	{ hv_rd_vp_index, "hv_rd_vp_index", has_hv_vp_index, .parallel = 1 },
+	{ hv_rd_guest_os_id, "hv_rd_guest_os_id", has_hv_hypercall, .parallel = 1 },
+	{ hv_wr_guest_os_id, "hv_wr_guest_os_id", has_hv_hypercall, .parallel = 1 },
+	{ hv_hypercall_invalid, "hv_hypercall_invalid", has_hv_hypercall, .parallel = 1 },
+	{ dev_cmos_8, "dev_cmos_8", .parallel = 0 },
+	{ dev_cmos_16, "dev_cmos_16", .parallel = 0 },
+	{ dev_cmos_32, "dev_cmos_32", .parallel = 0 },
+	{ dev_pit_8, "dev_pit_8", .parallel = 0 },
+	{ dev_pit_16, "dev_pit_16", .parallel = 0 },
+	{ dev_pit_32, "dev_pit_32", .parallel = 0 },
+	{ dev_post_8, "dev_post_8", .parallel = 0 },
+	{ dev_pci_cfg_8, "dev_pci_cfg_8", .parallel = 0 },
+	{ dev_pci_cfg_16, "dev_pci_cfg_16", .parallel = 0 },
+	{ dev_pci_cfg_32, "dev_pci_cfg_32", .parallel = 0 },
+	{ dev_uart_lsr_8, "dev_uart_lsr_8", .parallel = 0 },
+	{ dev_xapic_read_32, "dev_xapic_read_32", is_xapic, .parallel = 0 },
+	{ dev_xapic_write_32, "dev_xapic_write_32", is_xapic, .parallel = 0 },
+	{ dev_ioapic_32, "dev_ioapic_32", .parallel = 0 },
 	{ NULL, "pci-mem", .parallel = 0, .next = pci_mem_next },
 	{ NULL, "pci-io", .parallel = 0, .next = pci_io_next },
 };
 
+/*
+ * One per participating CPU. Every CPU sums its own cost; only CPU 0,
+ * the one running do_test(), keeps the individual samples.
+ */
+struct run_arg {
+	void (*func)(void);
+	u64 cycles;
+	u64 *samples;
+};
+
 unsigned iterations;
+static u64 samples[VMEXIT_MAX_SAMPLES];
+static struct run_arg run_args[64];
+static u64 tsc_overhead;
+static bool sweep;
+
+/*
+ * Expected cost per result name ("cpuid", "cpuid@4"), from "name=cycles"
+ * entries in the VMEXIT_BASELINE environment variable (separated by
+ * blanks or commas) or on the command line. A median above the baseline
+ * by more than the tolerance, VMEXIT_TOLERANCE or "tolerance=N" percent,
+ * is a failure. The median is compared because it is the least noisy.
+ * A baseline that no result matched is a failure too, so that a typo or a
+ * renamed test does not silently pass.
+ */
+#define VMEXIT_MAX_BASELINES 64
+#define VMEXIT_DEFAULT_TOLERANCE 10
+
+struct baseline {
+	char name[48];
+	u64 cycles;
+	bool matched;
+};
+
+static struct baseline baselines[VMEXIT_MAX_BASELINES];
+static int nr_baselines;
+static u64 tolerance = VMEXIT_DEFAULT_TOLERANCE;
 
-static void run_test(void *_func)
+static bool is_baseline_sep(char c)
 {
-    int i;
-    void (*func)(void) = _func;
+	return c == ' ' || c == ',' || c == '\t' || c == '\n';
+}
+
+/* @s must be a plain decimal number */
+static u64 parse_baseline_value(const char *s, const char *what)
+{
+	const char *p;
 
-    for (i = 0; i < iterations; ++i)
-        func();
+	for (p = s; *p >= '0' && *p <= '9'; p++)
+		;
+	if (p == s || *p)
+		report_abort("vmexit: bad %s value '%s'", what, s);
+	return atol(s);
 }
 
-static bool do_test(struct test *test)
+/* Add the "name=cycles" entry in @tok[0..len) */
+static void add_baseline(const char *tok, int len)
+{
+	char buf[sizeof(baselines[0].name) + 24];
+	struct baseline *b;
+	char *eq;
+
+	if (len >= sizeof(buf) || nr_baselines == VMEXIT_MAX_BASELINES)
+		report_abort("vmexit: baseline entry too long or too many");
+	memcpy(buf, tok, len);
+	buf[len] = '\0';
+
+	eq = strchr(buf, '=');
+	if (!eq || eq == buf || !eq[1] ||
+	    eq - buf >= sizeof(baselines[0].name))
+		report_abort("vmexit: bad baseline entry '%s'", buf);
+	*eq = '\0';
+
+	if (strcmp(buf, "tolerance") == 0) {
+		tolerance = parse_baseline_value(eq + 1, "tolerance");
+		return;
+	}
+	b = &baselines[nr_baselines++];
+	strcpy(b->name, buf);
+	b->cycles = parse_baseline_value(eq + 1, buf);
+}
+
+static void parse_baselines(const char *s)
 {
+	int len;
+
+	while (*s) {
+		while (is_baseline_sep(*s))
+			s++;
+		for (len = 0; s[len] && !is_baseline_sep(s[len]); len++)
+			;
+		if (len)
+			add_baseline(s, len);
+		s += len;
+	}
+}
+
+static void check_baseline(const char *name, const struct stats *st)
+{
+	u64 limit;
 	int i;
-	unsigned long long t1, t2;
-        void (*func)(void);
 
-        iterations = 32;
+	for (i = 0; i < nr_baselines; i++) {
+		if (strcmp(baselines[i].name, name))
+			continue;
+		baselines[i].matched = true;
+		limit = baselines[i].cycles * (100 + tolerance) / 100;
+		report("%s median %" PRIu64 " within %" PRIu64 "%% of baseline %"
+		       PRIu64, st->median <= limit, name, st->median,
+		       tolerance, baselines[i].cycles);
+		return;
+	}
+}
+
+static void check_unmatched_baselines(void)
+{
+	int i;
+
+	for (i = 0; i < nr_baselines; i++)
+		if (!baselines[i].matched)
+			report("baseline %s matched a result", false,
+			       baselines[i].name);
+}
+
+static void run_test(void *data)
+{
+	struct run_arg *arg = data;
+	int i;
+	u64 t;
+
+	for (i = 0; i < iterations; ++i) {
+		t = rdtsc();
+		arg->func();
+		t = rdtsc() - t;
+		t = t > tsc_overhead ? t - tsc_overhead : 0;
+		arg->cycles += t;
+		if (arg->samples)
+			*arg->samples++ = t;
+	}
+}
+
+/* Like on_cpus(), but CPUs @ncpus and up stay parked */
+static void run_on(int ncpus)
+{
+	int cpu;
+
+	run_cpus = ncpus;
+	for (cpu = ncpus - 1; cpu > 0; --cpu)
+		on_cpu_async(cpu, run_test, &run_args[cpu]);
+	run_test(&run_args[0]);
+
+	while (cpus_active() > 1)
+		pause();
+}
+
+static void measure_tsc_overhead(void)
+{
+	u64 t, min = ~0ull;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		t = rdtsc();
+		t = rdtsc() - t;
+		min = MIN(min, t);
+	}
+	tsc_overhead = min;
+}
+
+/* Returns the median cost */
+static u64 measure(const char *name, void (*func)(void), int ncpus)
+{
+	u64 cost, min = ~0ull, max = 0, sum = 0;
+	struct stats st;
+	int cpu, n = 0;
+
+	for (cpu = 0; cpu < ncpus; cpu++)
+		run_args[cpu] = (struct run_arg){ .func = func };
+	iterations = VMEXIT_WARMUP;
+	run_on(ncpus);
+
+	for (cpu = 0; cpu < ncpus; cpu++)
+		run_args[cpu].cycles = 0;
+	iterations = VMEXIT_CHUNK;
+	do {
+		run_args[0].samples = samples + n;
+		run_on(ncpus);
+		n += VMEXIT_CHUNK;
+	} while (n < VMEXIT_MAX_SAMPLES &&
+		 (n < VMEXIT_MIN_SAMPLES ||
+		  stats_ci_permille(samples, n) > VMEXIT_CI_PERMILLE));
+
+	stats_compute(samples, n, &st);
+	printf("%s %d\n", name, (int)st.mean);
+	stats_print(name, &st);
+	check_baseline(name, &st);
+	if (ncpus == 1)
+		return st.median;
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		cost = run_args[cpu].cycles / n;
+		min = MIN(min, cost);
+		max = MAX(max, cost);
+		sum += cost;
+	}
+	printf("%s per-vcpu min=%" PRIu64 " mean=%" PRIu64 " max=%" PRIu64
+	       "\n", name, min, sum / ncpus, max);
+	return st.median;
+}
+
+/*
+ * In sweep mode a parallel test is repeated on 1, 2, 4, ... and finally
+ * all CPUs, so that contention inside the hypervisor shows up as cost
+ * growing with the width instead of disappearing in one average.
+ */
+static bool do_test(struct test *test)
+{
+	char name[64];
+	int width;
+        void (*func)(void);
 
         if (test->valid && !test->valid()) {
 		printf("%s (skipped)\n", test->name);
@@ -508,19 +873,18 @@ static bool do_test(struct test *test)
 		return false;
 	}
 
-	do {
-		iterations *= 2;
-		t1 = rdtsc();
-
-		if (!test->parallel) {
-			for (i = 0; i < iterations; ++i)
-				func();
-		} else {
-			on_cpus(run_test, func);
+	if (!test->parallel) {
+		test->median = measure(test->name, func, 1);
+	} else if (!sweep || nr_cpus == 1) {
+		test->median = measure(test->name, func, nr_cpus);
+	} else {
+		for (width = 1; ; width = MIN(width * 2, nr_cpus)) {
+			snprintf(name, sizeof(name), "%s@%d", test->name, width);
+			test->median = measure(name, func, width);
+			if (width == nr_cpus)
+				break;
 		}
-		t2 = rdtsc();
-	} while ((t2 - t1) < GOAL);
-	printf("%s %d\n", test->name, (int)((t2 - t1) / iterations));
+	}
 	return test->next;
 }
 
@@ -532,22 +896,72 @@ static void enable_nx(void *junk)
 
 static bool test_wanted(struct test *test, char *wanted[], int nwanted)
 {
-	int i;
+	int i, len;
 
 	if (!nwanted)
 		return true;
 
-	for (i = 0; i < nwanted; ++i)
+	/* a trailing '*' matches by prefix, e.g. "dev_*" */
+	for (i = 0; i < nwanted; ++i) {
+		len = strlen(wanted[i]);
+		if (len && wanted[i][len - 1] == '*' &&
+		    strncmp(wanted[i], test->name, len - 1) == 0)
+			return true;
 		if (strcmp(wanted[i], test->name) == 0)
 			return true;
+	}
 
 	return false;
 }
 
+static struct test *find_test(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (strcmp(tests[i].name, name) == 0)
+			return &tests[i];
+	return NULL;
+}
+
+/* Median cycles of the dev_* cases that ran, one row per device */
+static void print_dev_matrix(void)
+{
+	static const char *devs[] = {
+		"cmos", "pit", "post", "pci_cfg", "uart_lsr",
+		"xapic_read", "xapic_write", "ioapic",
+	};
+	static const int bits[] = { 8, 16, 32 };
+	char name[48], cells[3][24];
+	struct test *t;
+	bool any;
+	int d, b;
+
+	printf("%-12s %10d %10d %10d\n", "device", 8, 16, 32);
+	for (d = 0; d < ARRAY_SIZE(devs); d++) {
+		any = false;
+		for (b = 0; b < ARRAY_SIZE(bits); b++) {
+			snprintf(name, sizeof(name), "dev_%s_%d", devs[d], bits[b]);
+			t = find_test(name);
+			if (t && t->median) {
+				snprintf(cells[b], sizeof(cells[b]), "%" PRIu64,
+					 t->median);
+				any = true;
+			} else {
+				strcpy(cells[b], "-");
+			}
+		}
+		if (any)
+			printf("%-12s %10s %10s %10s\n", devs[d],
+			       cells[0], cells[1], cells[2]);
+	}
+}
+
 int main(int ac, char **av)
 {
 	struct fadt_descriptor_rev1 *fadt;
-	int i;
+	int i, nwanted;
+	char *env;
 	unsigned long membar = 0;
 	struct pci_dev pcidev;
 	int ret;
@@ -556,6 +970,10 @@ int main(int ac, char **av)
 	setup_vm();
 	handle_irq(IPI_TEST_VECTOR, self_ipi_isr);
 	nr_cpus = cpu_count();
+	assert(nr_cpus <= ARRAY_SIZE(run_args));
+	measure_tsc_overhead();
+	if (has_hv_hypercall())
+		hv_setup_hypercall();
 
 	irq_enable();
 	on_cpus(enable_nx, NULL);
@@ -576,9 +994,38 @@ int main(int ac, char **av)
 		       pcidev.bdf, membar, pci_test.iobar);
 	}
 
+	/* "sweep [test...]" runs parallel tests at every width */
+	if (ac > 1 && strcmp(av[1], "sweep") == 0) {
+		sweep = true;
+		ac--;
+		av++;
+	}
+
+	env = getenv("VMEXIT_BASELINE");
+	if (env)
+		parse_baselines(env);
+	env = getenv("VMEXIT_TOLERANCE");
+	if (env)
+		tolerance = parse_baseline_value(env, "VMEXIT_TOLERANCE");
+
+	/* "name=cycles" arguments are baselines, not test names */
+	for (i = 1, nwanted = 0; i < ac; i++) {
+		if (strchr(av[i], '='))
+			parse_baselines(av[i]);
+		else
+			av[1 + nwanted++] = av[i];
+	}
+
 	for (i = 0; i < ARRAY_SIZE(tests); ++i)
-		if (test_wanted(&tests[i], av + 1, ac - 1))
+		if (test_wanted(&tests[i], av + 1, nwanted))
 			while (do_test(&tests[i])) {}
 
-	return 0;
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (strncmp(tests[i].name, "dev_", 4) == 0 && tests[i].median)
+			break;
+	if (i < ARRAY_SIZE(tests))
+		print_dev_matrix();
+
+	check_unmatched_baselines();
+	return nr_baselines ? report_summary() : 0;
 }
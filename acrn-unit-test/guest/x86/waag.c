@@ -3,132 +3,13 @@
 #include "vm.h"
 #include "alloc_page.h"
 #include "smp.h"
-
-/* Hyper-V MSR numbers */
-#define HV_X64_MSR_GUEST_OS_ID		0x40000000U
-#define HV_X64_MSR_HYPERCALL		0x40000001U
-#define HV_X64_MSR_VP_INDEX		0x40000002U
-
-#define HV_X64_MSR_TIME_REF_COUNT	0x40000020U
-#define HV_X64_MSR_REFERENCE_TSC	0x40000021U
-
-#define HV_X64_MSR_TSC_FREQUENCY	0x40000022U
-/**/
-/********************************************/
-/*          timer calibration  */
-/********************************************/
-uint64_t tsc_hz;
-uint64_t apic_timer_hz;
-uint64_t cpu_hz;
-uint64_t bus_hz;
-struct hv_reference_tsc_page {
-        u32 tsc_sequence;
-        u32 res1;
-        uint64_t tsc_scale;
-        int64_t tsc_offset;
-};
-
-static void tsc_calibrate(void)
-{
-	u32 eax_denominator, ebx_numerator, ecx_crystal_hz, reserved;
-	u32 eax_base_mhz = 0, ebx_max_mhz = 0, ecx_bus_mhz = 0, edx;
-
-	__asm volatile("cpuid"
-	    :"=a"(eax_denominator), "=b"(ebx_numerator), "=c"(ecx_crystal_hz), "=d"(reserved)
-	    : "0" (0x15), "2" (0)
-	    : "memory");
-
-	printf("crystal_hz:%u\n\r",ecx_crystal_hz);
-	
-	if (ecx_crystal_hz != 0) {
-		tsc_hz = ((uint64_t) ecx_crystal_hz *
-		        ebx_numerator) / eax_denominator;
-		apic_timer_hz = ecx_crystal_hz;
-	} else {
-
-		__asm volatile("cpuid"
-		    :"=a"(eax_base_mhz), "=b"(ebx_max_mhz), "=c"(ecx_bus_mhz), "=d"(edx)
-		    : "0" (0x16), "2" (0)
-		    : "memory");
-
-		tsc_hz = (uint64_t) eax_base_mhz * 1000000U;
-		apic_timer_hz = tsc_hz * eax_denominator / ebx_numerator;
-	}
-
-	cpu_hz = eax_base_mhz * 1000000U;
-	bus_hz = ecx_bus_mhz * 1000000U;
-	printf("apic_timer_hz: %lu\n", apic_timer_hz);
-	printf("tsc_hz: %lu\n", tsc_hz);
-	printf("cpu_hz: %lu\n", cpu_hz);
-	printf("bus_hz: %lu\n", bus_hz);
-
-	/* apic_timer_hz: 23863636; 16C 2154H
-	 * tsc_hz: 2100000000
-	 * cpu_hz: 2100000000
-	 * bus_hz: 100000000
-	 */
-}
+#include "hyperv.h"
+#include "calibrate.h"
 
 bool smp_done = false;
 u64 vp_index = 0;
 int vp_id = 0;
 struct hv_reference_tsc_page *hv_clock;
-static void *hypercall_page;
-#define HV_HYPERCALL_FAST			(1u << 16)
-#define HV_X64_MSR_HYPERCALL_ENABLE 0x1
-
-static void setup_hypercall(void)
-{
-	u64 guestid = (0x8f00ull << 48);
-
-	hypercall_page = alloc_page();
-	if (!hypercall_page)
-		report_abort("failed to allocate hypercall page");
-	memset(hypercall_page, 0, PAGE_SIZE);
-
-	wrmsr(HV_X64_MSR_GUEST_OS_ID, guestid);
-
-	wrmsr(HV_X64_MSR_HYPERCALL,
-	      (u64)virt_to_phys(hypercall_page) | HV_X64_MSR_HYPERCALL_ENABLE);
-}
-
-static void teardown_hypercall(void)
-{
-	wrmsr(HV_X64_MSR_HYPERCALL, 0);
-	wrmsr(HV_X64_MSR_GUEST_OS_ID, 0);
-	free_page(hypercall_page);
-}
-
-
-static u64 do_hypercall(u16 code, u64 arg, bool fast)
-{
-	u64 ret;
-	u64 tmp;
-	u64 ctl = code;
-	printf("arg:%lx ",arg);
-	if (fast)
-		ctl |= HV_HYPERCALL_FAST;
-
-	asm volatile ("call *%[hcall_page]"
-#ifdef __x86_64__
-		      "\n mov $0,%%r8"
-		      : "=a"(ret)
-		      : "c"(ctl), "d"(arg),
-#else
-		      : "=A"(ret)
-		      : "A"(ctl),
-			"b" ((u32)(arg >> 32)), "c" ((u32)arg),
-			"D"(0), "S"(0),
-#endif
-		      [hcall_page] "m" (hypercall_page)
-#ifdef __x86_64__
-		      : "r8"
-#endif
-		     );
-	asm volatile("mov %%rdx,%0":"=r"(tmp)::"rdx"); 
-	printf("tmp:0x%lx,arg:0x%lx \n\r",tmp,arg);
-	return ret;
-}
 
 void get_vp_index()
 {
@@ -136,18 +17,15 @@ void get_vp_index()
 	vp_id = smp_id();
 	smp_done = true;
 }
-#define HV_STATUS_INVALID_HYPERCALL_CODE 0x2
 void hvcall_test()
 {
-#define HVCALL_SIGNAL_EVENT                     0x5d
 	u64 ret;
-	//u64 tmp;
-	setup_hypercall();
-	//asm volatile ("mov %rdx,%0":=(tmp)::"rdx");
-	ret = do_hypercall(HVCALL_SIGNAL_EVENT,2,1);
+
+	hv_setup_hypercall();
+	ret = hv_do_fast_hypercall(HVCALL_SIGNAL_EVENT, 2, 0);
 	printf("do_hypercall ret:0x%lx\n\r",ret);
 	report("hypercall test", ret == HV_STATUS_INVALID_HYPERCALL_CODE);
-	teardown_hypercall();
+	hv_teardown_hypercall();
 }
 
 void main()
@@ -222,7 +100,7 @@ void main()
 	u32 ecx = 0;
 	printf("tsc: 0x%llx, tscp: 0x%llx\n\r",rdtsc(),rdtscp(&ecx));
 
-	tsc_calibrate();
+	timebase_init();
 
 	hv_clock = alloc_page();
 	
@@ -6,15 +6,10 @@
 #include "desc.h"
 #include "isr.h"
 #include "apic.h"
-
-/* Hyper-V MSR numbers */
-#define HV_X64_MSR_GUEST_OS_ID		0x40000000U
-#define HV_X64_MSR_HYPERCALL		0x40000001U
-#define HV_X64_MSR_VP_INDEX		0x40000002U
-
-#define HV_X64_MSR_TIME_REF_COUNT	0x40000020U
-#define HV_X64_MSR_REFERENCE_TSC	0x40000021U
-#define HV_X64_MSR_TSC_FREQUENCY	0x40000022U
+#include "atomic.h"
+#include "stats.h"
+#include "hyperv.h"
+#include "calibrate.h"
 
 /* Partition Reference Counter (HV_X64_MSR_TIME_REF_COUNT) */
 #define CPUID3A_TIME_REF_COUNT_MSR	(1U << 1U)
@@ -25,138 +20,10 @@
 /* Partition reference TSC MSR (HV_X64_MSR_REFERENCE_TSC) */
 #define CPUID3A_REFERENCE_TSC_MSR	(1U << 9U)
 
-/**/
-/********************************************/
-/*          timer calibration  */
-/********************************************/
-uint64_t tsc_hz;
-uint64_t apic_timer_hz;
-uint64_t cpu_hz;
-uint64_t bus_hz;
-struct hv_reference_tsc_page {
-	volatile u32 tsc_sequence;
-	u32 res1;
-	volatile uint64_t tsc_scale;
-	volatile int64_t tsc_offset;
-};
-
-static void tsc_calibrate(void)
-{
-	u32 eax_denominator, ebx_numerator, ecx_crystal_hz, reserved;
-	u32 eax_base_mhz = 0, ebx_max_mhz = 0, ecx_bus_mhz = 0, edx;
-
-	__asm volatile("cpuid"
-	    :"=a"(eax_denominator), "=b"(ebx_numerator), "=c"(ecx_crystal_hz), "=d"(reserved)
-	    : "0" (0x15), "2" (0)
-	    : "memory");
-
-	printf("crystal_hz:%u\n\r",ecx_crystal_hz);
-	if (ecx_crystal_hz != 0) {
-		tsc_hz = ((uint64_t) ecx_crystal_hz *
-		        ebx_numerator) / eax_denominator;
-		apic_timer_hz = ecx_crystal_hz;
-	} else {
-
-		__asm volatile("cpuid"
-		    :"=a"(eax_base_mhz), "=b"(ebx_max_mhz), "=c"(ecx_bus_mhz), "=d"(edx)
-		    : "0" (0x16), "2" (0)
-		    : "memory");
-
-		tsc_hz = (uint64_t) eax_base_mhz * 1000000U;
-		apic_timer_hz = tsc_hz * eax_denominator / ebx_numerator;
-	}
-
-	cpu_hz = eax_base_mhz * 1000000U;
-	bus_hz = ecx_bus_mhz * 1000000U;
-	printf("apic_timer_hz: %lu\n", apic_timer_hz);
-	printf("tsc_hz: %lu\n", tsc_hz);
-	printf("cpu_hz: %lu\n", cpu_hz);
-	printf("bus_hz: %lu\n", bus_hz);
-
-	/* apic_timer_hz: 23863636; 16C 2154H
-	 * tsc_hz: 2100000000
-	 * cpu_hz: 2100000000
-	 * bus_hz: 100000000
-
-	 */
-}
-
 struct hv_reference_tsc_page *hv_clock;
-static void *hypercall_page;
 
-#define HV_HYPERCALL_FAST			(1u << 16)
-#define HV_X64_MSR_HYPERCALL_ENABLE 0x1
 #define TICKS_PER_SEC_RTSC_COUNT (1000000000 / 100)
 
-static void setup_hypercall(void)
-{
-	u64 guestid = (0x8f00ull << 48);
-
-	hypercall_page = alloc_page();
-	if (!hypercall_page)
-		report_abort("failed to allocate hypercall page");
-	memset(hypercall_page, 0, PAGE_SIZE);
-
-	wrmsr(HV_X64_MSR_GUEST_OS_ID, guestid);
-	wrmsr(HV_X64_MSR_HYPERCALL,
-	      (u64)virt_to_phys(hypercall_page) | HV_X64_MSR_HYPERCALL_ENABLE);
-}
-
-static void teardown_hypercall(void)
-{
-	wrmsr(HV_X64_MSR_HYPERCALL, 0);
-	wrmsr(HV_X64_MSR_GUEST_OS_ID, 0);
-	free_page(hypercall_page);
-}
-
-
-static u64 do_hypercall(u16 code, u64 arg, bool fast)
-{
-	u64 ret;
-	u32 tmp;
-	u64 ctl = code;
-	if (fast)
-		ctl |= HV_HYPERCALL_FAST;
-
-	asm volatile ("call *%[hcall_page]"
-#ifdef __x86_64__
-		      "\n mov $0,%%r8"
-		      : "=a"(ret)
-		      : "c"(ctl), "d"(arg),
-#else
-		      : "=A"(ret)
-		      : "A"(ctl),
-			"b" ((u32)(arg >> 32)), "c" ((u32)arg),
-			"D"(0), "S"(0),
-#endif
-		      [hcall_page] "m" (hypercall_page)
-#ifdef __x86_64__
-		      : "r8"
-#endif
-		     );
-#ifdef __x86_64__
-	asm volatile("mov %%edx,%0":"=r"(tmp)::"edx");
-	if((arg & 0xffffffff) != tmp)
-		ret = -1;
-#endif
-	return ret;
-}
-
-#define HV_STATUS_INVALID_HYPERCALL_CODE 0x2
-void hvcall_test()
-{
-#define HVCALL_SIGNAL_EVENT                     0x5d
-	u64 ret;
-	setup_hypercall();
-	ret = do_hypercall(HVCALL_SIGNAL_EVENT,2,1);
-/*
-*up to now ,we do not support any hypercall,
-*just return HV_STATUS_INVALID_HYPERCALL_CODE
-*/
-	report("hypercall test", ret == HV_STATUS_INVALID_HYPERCALL_CODE);
-	teardown_hypercall();
-}
-
 /*A hypervisor conformant with the Microsoft hypervisor interface
 	will set CPUID.1:ECX [bit 31] = 1
 	to indicate its presence to software*/
@@ -250,7 +117,7 @@ static void check_hw_feature()
 }
 static void x64_msr_gust_osid()
 {
-	u64 guestid = (0x8f00ull << 48);
+	u64 guestid = HV_TEST_GUEST_OS_ID;
 	report("TC_TLFS_MinimalSet_009 check HV_X64_MSR_GUEST_OS_ID initial value",	\
 		rdmsr(HV_X64_MSR_GUEST_OS_ID) == 0);
 
@@ -265,7 +132,8 @@ static void x64_msr_hvcall()
 {
 	/*refer Hypervisor Top Level Functional Specification
 	2.6 Reporting the Guest OS Identity*/
-	u64 guestid = (0x8f00ull << 48);
+	u64 guestid = HV_TEST_GUEST_OS_ID;
+	void *hypercall_page;
 
 	report("TC_TLFS_MinimalSet_011 check HV_X64_MSR_HYPERCALL initial value", \
 		rdmsr(HV_X64_MSR_HYPERCALL) == 0);
@@ -295,7 +163,9 @@ while HV_X64_MSR_GUEST_OS_ID MSR is set",
 	report("TC_TLFS_MinimalSet_014 check clear HV_X64_MSR_GUEST_OS_ID to disable hypercall page", \
 		(rdmsr(HV_X64_MSR_HYPERCALL) & HV_X64_MSR_HYPERCALL_ENABLE) == 0);
 
-	teardown_hypercall();
+	wrmsr(HV_X64_MSR_HYPERCALL, 0);
+	wrmsr(HV_X64_MSR_GUEST_OS_ID, 0);
+	free_page(hypercall_page);
 
 }
 static void check_hvcall()
@@ -303,21 +173,31 @@ static void check_hvcall()
 
 	/*refer Hypervisor Top Level Functional Specification
 	chap 3. Hypercall Interface*/
-#define HVCALL_SIGNAL_EVENT                     0x5d
 	u64 ret;
+	u64 control = hv_hypercall_control(HVCALL_SIGNAL_EVENT, true, 0, 0, 0);
+	u64 input = 2;
 
-	setup_hypercall();
-	ret = do_hypercall(HVCALL_SIGNAL_EVENT,2,1);
+	hv_setup_hypercall();
+	/*
+	*up to now ,we do not support any hypercall,
+	*just return HV_STATUS_INVALID_HYPERCALL_CODE;
+	*the fast call input register must come back unchanged
+	*/
+	asm volatile ("call *%[hcall_page]"
+		      : "=a"(ret), "+c"(control), "+d"(input)
+		      : [hcall_page] "m" (hv_hypercall_page)
+		      : "r8", "r9", "r10", "r11", "memory");
+	if ((u32)input != 2)
+		ret = -1;
 	report("TC_TLFS_MinimalSet_015 test Hypercall interface ",	\
 		ret == HV_STATUS_INVALID_HYPERCALL_CODE);
 
-	teardown_hypercall();
+	hv_teardown_hypercall();
 }
 static void check_vp_index()
 {
-	/*unitl now, we just support one cpu for waag, maybe ,
-	this will change in future, if we support more than one cpu,
-	we need rdmsr for each cpu*/
+	/*the conformance run is single-vCPU, so only the BSP is checked
+	here; the "vp_index_map" mode checks every vCPU*/
 	u64 vp_index;
 	unsigned char vector = 0;
 
@@ -334,6 +214,22 @@ static void check_vp_index()
 	report("TC_TLFS_MinimalSet_017 check wirting HV_X64_MSR_VP_INDEX", \
 		vector == GP_VECTOR);
 }
+
+/* every vCPU must have its own VP index; needs the APs up */
+static void check_vp_index_map(void)
+{
+	int cpu, ncpus = MAX(cpu_count(), 1);
+	bool unique = true;
+
+	hv_vp_index_map_init();
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		printf("vCPU %d: VP index %u\n", cpu, hv_vp_index(cpu));
+		if (hv_vp_index_to_cpu(hv_vp_index(cpu)) != cpu)
+			unique = false;
+	}
+	report("TC_TLFS_MinimalSet_018 check HV_X64_MSR_VP_INDEX is unique per vCPU", \
+		unique);
+}
 static void check_iTSC_support()
 {
 	/*A partition reference time enlightenment,
@@ -369,15 +265,10 @@ static void ref_count_msr_init()
 /*simple sleep for xxx ns*/
 static void sleep_ns(u64 ns)
 {
-#define TSC_TICKS_PER_NS (tsc_hz / 1000000000)
-	u64 tsc;
+	u64 end = rdtsc() + ns_to_tsc(ns);
 
-	tsc = rdtsc();
-	while(1){
+	while (rdtsc() < end)
 		asm volatile("nop");
-		if ((tsc + ns * TSC_TICKS_PER_NS) < rdtsc())
-			break;
-	}
 }
 
 static void x64_msr_ref_count()
@@ -406,82 +297,149 @@ static void x64_msr_ref_count()
 	report("TC_TLFS_TSC_WaaG_004 reference count is monotonically increasing", ok);
 }
 
-#define TSC_DEADLINE_TIMER_VECTOR 0xef
-bool volatile tdt_isr = false;
-
-static void tsc_deadline_timer_isr(isr_regs_t *regs)
-{
-    tdt_isr = true;
-    eoi();
-}
+/*
+ * TC_TLFS_TSC_WaaG_005: the reference counter must advance 10^7 times a
+ * second, to within 100 ticks (0.01ms) per second.
+ *
+ * Instead of timing whole seconds, (TSC, TIME_REF_COUNT) pairs are taken
+ * every millisecond and TIME_REF_COUNT is fitted against the TSC by least
+ * squares. The test passes when the whole 95% confidence interval of the
+ * fitted rate lies within the tolerance, and sampling stops as soon as
+ * the interval is entirely inside or entirely outside it, normally well
+ * under a second. Disturbed pairs are rejected, but at most
+ * RTSC_CAL_MAX_ATTEMPTS pairs are tried in total.
+ */
+#define RTSC_CAL_TOLERANCE		100	/* ticks per second */
+#define RTSC_CAL_MIN_POINTS		32
+#define RTSC_CAL_MAX_POINTS		1024
+#define RTSC_CAL_MAX_ATTEMPTS		(4 * RTSC_CAL_MAX_POINTS)
+#define RTSC_CAL_CHECK_EVERY		16
+#define RTSC_CAL_FRAC_SHIFT		8
+
+static s64 rtsc_cal_x[RTSC_CAL_MAX_POINTS];
+static s64 rtsc_cal_y[RTSC_CAL_MAX_POINTS];
 
-static bool __test_tsc_deadline_timer(void)
+/*
+ * The TSC axis is converted to 100ns units with timebase.tsc_hz, so a
+ * correct counter has slope 1 and the rate error in ticks per second is
+ * (slope - 1) * 10^7. Both axes carry RTSC_CAL_FRAC_SHIFT fraction bits.
+ * @err and @ci receive the rate error and the 95% half width (about two
+ * standard errors of the slope) in 1/100 ticks per second.
+ */
+static void rtsc_fit(int n, s64 *err, u64 *ci)
 {
-	u64 ticks1,ticks2,tsc;
-	/*
-	*the delta should be less than 0.01ms according to the test case design;
-	*0.01ms need 100 time_ref_count's ticks
-	*/
-	u64 delta_ticks = 100;
-	bool ret = true;
+	__int128 sx = 0, sy = 0, cxx = 0, cxy = 0, ssres = 0, r, v;
+	s64 xbar, ybar;
+	int i;
 
-	/*
-	*we start 1s tsc deadline timer to calculate time reference count MSR
-	*/
-	tsc = rdmsr(MSR_IA32_TSC);
-	tsc += tsc_hz;
-	ticks1 = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
-	wrmsr(MSR_IA32_TSCDEADLINE, tsc);
+	for (i = 0; i < n; i++) {
+		sx += rtsc_cal_x[i];
+		sy += rtsc_cal_y[i];
+	}
+	xbar = sx / n;
+	ybar = sy / n;
 
-	while(!tdt_isr);
+	for (i = 0; i < n; i++) {
+		cxx += (__int128)(rtsc_cal_x[i] - xbar) * (rtsc_cal_x[i] - xbar);
+		cxy += (__int128)(rtsc_cal_x[i] - xbar) * (rtsc_cal_y[i] - ybar);
+	}
 
-	ticks2 = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
-	tdt_isr = false;
+	for (i = 0; i < n; i++) {
+		r = (rtsc_cal_y[i] - ybar) -
+			cxy * (rtsc_cal_x[i] - xbar) / cxx;
+		ssres += r * r;
+	}
 
-	if ((TICKS_PER_SEC_RTSC_COUNT + delta_ticks) < (ticks2 - ticks1)
-		|| (TICKS_PER_SEC_RTSC_COUNT - delta_ticks) > (ticks2 -ticks1))
-		ret = false;
+	*err = (cxy - cxx) * TICKS_PER_SEC_RTSC_COUNT * 100 / cxx;
 
-	return ret;
+	/* (2 * 10^7 * 100)^2 * ssres / ((n - 2) * cxx) */
+	v = 4 * (__int128)1000000000000000000ll * ssres / ((n - 2) * cxx);
+	*ci = stats_isqrt(v > (__int128)~0ull ? ~0ull : (u64)v);
 }
 
-static int enable_tsc_deadline_timer(void)
+/*
+ * Take one (TSC, TIME_REF_COUNT) pair, using the middle of the two TSC
+ * reads around the MSR access. Pairs whose reads are further apart than
+ * @max_bracket were disturbed and are rejected.
+ */
+static bool rtsc_sample(u64 tsc0, u64 ref0, u64 max_bracket, s64 *x, s64 *y)
 {
-	u32 lvtt;
-
-	if (cpuid(1).c & (1 << 24)) {
-		lvtt = APIC_LVT_TIMER_TSCDEADLINE | TSC_DEADLINE_TIMER_VECTOR;
-		apic_write(APIC_LVTT, lvtt);
-		return 1;
-	} else {
-		return 0;
-	}
+	u64 t1, t2, ref;
+
+	t1 = rdtsc();
+	ref = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+	t2 = rdtsc();
+	if (t2 - t1 > max_bracket)
+		return false;
+
+	*x = ((unsigned __int128)((t1 + t2) / 2 - tsc0) *
+	      TICKS_PER_SEC_RTSC_COUNT << RTSC_CAL_FRAC_SHIFT) / timebase.tsc_hz;
+	*y = (s64)(ref - ref0) << RTSC_CAL_FRAC_SHIFT;
+	return true;
 }
 
 static void check_rtsc_freq(void)
 {
-	bool ret = true;
+	u64 tsc0, ref0, t1, t2, bracket = ~0ull, ci = ~0ull, next, ms, abs_err;
+	int i, n = 0, attempts = 0;
+	s64 err = 0;
+
+	if (!timebase.tsc_hz) {
+		report_skip("skip TC_TLFS_TSC_WaaG_005 reference count increases 1 with 100ns as a unit");
+		return;
+	}
 
-	printf("\tStart TC_TLFS_TSC_WaaG_005,it will take about 10s,pls waiting... ...\n\r");
+	/* calibrate the cost of an undisturbed MSR read */
+	for (i = 0; i < 16; i++) {
+		t1 = rdtsc();
+		rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+		t2 = rdtsc();
+		bracket = MIN(bracket, t2 - t1);
+	}
 
-	if(enable_tsc_deadline_timer()) {
-		handle_irq(TSC_DEADLINE_TIMER_VECTOR, tsc_deadline_timer_isr);
-		irq_enable();
-		for (char i=0; i<10; i++) {
-			if ( __test_tsc_deadline_timer() != true) {
-				ret = false;
+	tsc0 = rdtsc();
+	ref0 = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+	next = tsc0;
+	while (n < RTSC_CAL_MAX_POINTS && attempts++ < RTSC_CAL_MAX_ATTEMPTS) {
+		next += ns_to_tsc(1000000);
+		while (rdtsc() < next)
+			pause();
+
+		if (!rtsc_sample(tsc0, ref0, 2 * bracket,
+				 &rtsc_cal_x[n], &rtsc_cal_y[n]))
+			continue;
+		n++;
+
+		if (n >= RTSC_CAL_MIN_POINTS && n % RTSC_CAL_CHECK_EVERY == 0) {
+			rtsc_fit(n, &err, &ci);
+			abs_err = err < 0 ? -err : err;
+			if (abs_err + ci <= RTSC_CAL_TOLERANCE * 100 ||
+			    abs_err > RTSC_CAL_TOLERANCE * 100 + ci)
 				break;
-			}
 		}
-		report("TC_TLFS_TSC_WaaG_005 reference count tsc increases 1 with 100ns as a unit", ret);
-    } else {
-        report_skip("skip TC_TLFS_TSC_WaaG_005 reference count increases 1 with 100ns as a unit");
-    }
+	}
+
+	ms = tsc_to_ns(rdtsc() - tsc0) / 1000000;
+	if (n < RTSC_CAL_MIN_POINTS) {
+		printf("\treference count rate: only %d of %d pairs undisturbed\n",
+		       n, attempts);
+		report("TC_TLFS_TSC_WaaG_005 reference count tsc increases 1 with 100ns as a unit",
+		       0);
+		return;
+	}
+	rtsc_fit(n, &err, &ci);
+	abs_err = err < 0 ? -err : err;
+	printf("\treference count rate: %d points over %" PRIu64 " ms, error %s"
+	       STATS_X100_FMT " ticks/s, 95%% bound +-" STATS_X100_FMT "\n",
+	       n, ms, err < 0 ? "-" : "", STATS_X100(abs_err), STATS_X100(ci));
+
+	report("TC_TLFS_TSC_WaaG_005 reference count tsc increases 1 with 100ns as a unit",
+	       abs_err + ci <= RTSC_CAL_TOLERANCE * 100);
 }
 
 static void x64_msr_ref_tsc()
 {
-	u64 tsc,disc,tsc_scale,tsc_offset,tick;
+	u64 disc,tick = 0;
 	struct hv_reference_tsc_page * hv_rtsc_page;
 
 	report("TC_TLFS_TSC_WaaG_009 check HV_X64_MSR_REFERENCE_TSC MSR initial value", \
@@ -501,27 +459,625 @@ static void x64_msr_ref_tsc()
 		exit(1);
 	}
 
-	tsc_scale = hv_rtsc_page->tsc_scale;
-	tsc_offset = hv_rtsc_page->tsc_offset;
-	tsc = rdtsc();
-	/* ret = ((tsc * tsc_scale) >> 64) + tsc_offset */
-	asm volatile ("mulq %3" :
-		"=d" (tick), "=a" (disc) :
-		"a" (tsc), "r" (tsc_scale));
-	tick += tsc_offset;
+	/* ((tsc * tsc_scale) >> 64) + tsc_offset, under the sequence protocol */
+	hv_ref_tsc_read(hv_rtsc_page, &tick, NULL);
 	disc = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
 	/*we suppose the time is small,we just check it will be less than 1us*/
 	report("TC_TLFS_TSC_WaaG_011 reference TSC is synchronous with reference count",
 		(tick + 10) > disc);
 	free_page(hv_rtsc_page);
 }
-void main()
+
+/********************************************/
+/*          hypercall latency benchmark  */
+/********************************************/
+/* no hypercall is assigned this code in the TLFS */
+#define HVCALL_INVALID_CODE		0xffff
+
+#define BENCH_WARMUP			64
+#define BENCH_SAMPLES			4096
+
+static u64 bench_samples[BENCH_SAMPLES];
+static u64 hcall_input_gpa;
+static unsigned char vmcall_vector;
+
+static void bench_rdtsc(void)
+{
+}
+
+static void bench_vmcall_raw(void)
+{
+	unsigned long a = 0, b, c, d;
+
+	/* same exit as vmexit.c's "vmcall", survives an injected #UD */
+	asm volatile (ASM_TRY("1f")
+		      "vmcall\n\t"
+		      "1:"
+		      : "+a"(a), "=b"(b), "=c"(c), "=d"(d) : : "memory");
+	vmcall_vector = exception_vector();
+}
+
+static void bench_hcall_fast(void)
+{
+	hv_hypercall(hv_hypercall_control(HVCALL_SIGNAL_EVENT, true, 0, 0, 0),
+		     2, 0);
+}
+
+static void bench_hcall_slow(void)
+{
+	hv_hypercall(hv_hypercall_control(HVCALL_POST_MESSAGE, false, 0, 0, 0),
+		     hcall_input_gpa, 0);
+}
+
+static void bench_hcall_invalid(void)
+{
+	hv_hypercall(hv_hypercall_control(HVCALL_INVALID_CODE, true, 0, 0, 0),
+		     0, 0);
+}
+
+struct hcall_bench {
+	void (*func)(void);
+	const char *name;
+	struct stats st;
+};
+
+static struct hcall_bench hcall_benches[] = {
+	{ bench_rdtsc, "rdtsc_overhead" },
+	{ bench_vmcall_raw, "vmcall_raw" },
+	{ bench_hcall_fast, "hcall_fast" },
+	{ bench_hcall_slow, "hcall_slow" },
+	{ bench_hcall_invalid, "hcall_invalid" },
+};
+
+static bool bench_sample(int i, u64 *out, void *data)
+{
+	void (**func)(void) = data;
+	u64 t;
+
+	t = rdtsc();
+	(*func)();
+	*out = rdtsc() - t;
+	return true;
+}
+
+/* fills bench_samples[], to be reported before the next bench_run() */
+static void bench_run(void (*func)(void))
+{
+	stats_sample(bench_sample, &func, BENCH_WARMUP,
+		     bench_samples, BENCH_SAMPLES);
+}
+
+static void hcall_bench(void)
+{
+	struct hcall_bench *vmcall_raw = &hcall_benches[1];
+	struct hcall_bench *b;
+	u64 status;
+	int i;
+
+	hv_setup_hypercall();
+	hcall_input_gpa = virt_to_phys(hv_hypercall_input_page());
+
+	status = hv_do_fast_hypercall(HVCALL_INVALID_CODE, 0, 0);
+	report("hcall_bench: invalid code returns HV_STATUS_INVALID_HYPERCALL_CODE",
+	       hv_result(status) == HV_STATUS_INVALID_HYPERCALL_CODE);
+	printf("hcall_fast status 0x%lx, hcall_slow status 0x%lx\n",
+	       hv_do_fast_hypercall(HVCALL_SIGNAL_EVENT, 2, 0),
+	       hv_do_hypercall(HVCALL_POST_MESSAGE,
+			       hv_hypercall_input_page(), NULL));
+
+	irq_disable();
+	for (i = 0; i < ARRAY_SIZE(hcall_benches); i++) {
+		b = &hcall_benches[i];
+		bench_run(b->func);
+		stats_report(bench_samples, BENCH_SAMPLES, &b->st, "%s", b->name);
+	}
+
+	if (vmcall_vector)
+		printf("raw vmcall raised vector %d, vmcall_raw includes "
+		       "exception injection\n", vmcall_vector);
+
+	for (i = 2; i < ARRAY_SIZE(hcall_benches); i++) {
+		b = &hcall_benches[i];
+		printf("%s/vmcall_raw median ratio " STATS_X100_FMT "\n", b->name,
+		       STATS_X100(stats_ratio_x100(b->st.median,
+						   vmcall_raw->st.median)));
+	}
+
+	hv_teardown_hypercall();
+}
+
+/********************************************/
+/*      XMM fast hypercall input benchmark  */
+/********************************************/
+/*
+ * The same HvCallFlushVirtualAddressSpace/List input is sent once as an
+ * XMM fast call and once through the input page; rep count 0 is the
+ * 24-byte Space call, 11 fills all 112 bytes of register input.
+ */
+static const int xmm_bench_reps[] = { 0, 1, 5, 11 };
+
+static u64 xmm_payload[HV_HYPERCALL_MAX_XMM_INPUT / sizeof(u64)];
+static int xmm_payload_size;
+static u64 xmm_control;
+static u64 page_control;
+static void *hcall_input;
+
+static void bench_input_xmm(void)
+{
+	hv_hypercall_xmm(xmm_control, xmm_payload);
+}
+
+static void bench_input_page(void)
+{
+	memcpy(hcall_input, xmm_payload, xmm_payload_size);
+	hv_hypercall(page_control, hcall_input_gpa, 0);
+}
+
+static void xmm_bench(void)
+{
+	struct hv_tlb_flush *flush = (struct hv_tlb_flush *)xmm_payload;
+	struct stats xmm_st, page_st;
+	u64 status;
+	u16 code;
+	int i, reps;
+
+	if (!hv_xmm_input_supported()) {
+		report_skip("xmm_bench: XMM hypercall input is not offered");
+		return;
+	}
+
+	write_cr4(read_cr4() | X86_CR4_OSFXSR);
+	hv_setup_hypercall();
+	hcall_input = hv_hypercall_input_page();
+	hcall_input_gpa = virt_to_phys(hcall_input);
+
+	flush->address_space = 0;
+	flush->flags = HV_FLUSH_ALL_PROCESSORS |
+		HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES;
+	flush->processor_mask = 0;
+	for (i = 0; i < xmm_bench_reps[ARRAY_SIZE(xmm_bench_reps) - 1]; i++)
+		flush->gva_list[i] = (u64)i * PAGE_SIZE;
+
+	irq_disable();
+	for (i = 0; i < ARRAY_SIZE(xmm_bench_reps); i++) {
+		reps = xmm_bench_reps[i];
+		code = reps ? HVCALL_FLUSH_VIRTUAL_ADDRESS_LIST :
+			HVCALL_FLUSH_VIRTUAL_ADDRESS_SPACE;
+		xmm_payload_size = sizeof(*flush) + reps * sizeof(u64);
+		xmm_control = hv_hypercall_control(code, true, 0, reps, 0);
+		page_control = hv_hypercall_control(code, false, 0, reps, 0);
+
+		status = hv_hypercall_xmm(xmm_control, xmm_payload);
+		printf("%d bytes: xmm status 0x%lx", xmm_payload_size, status);
+		memcpy(hcall_input, xmm_payload, xmm_payload_size);
+		status = hv_hypercall(page_control, hcall_input_gpa, 0);
+		printf(", page status 0x%lx\n", status);
+
+		bench_run(bench_input_xmm);
+		stats_report(bench_samples, BENCH_SAMPLES, &xmm_st,
+			     "xmm_input_%dB", xmm_payload_size);
+		bench_run(bench_input_page);
+		stats_report(bench_samples, BENCH_SAMPLES, &page_st,
+			     "page_input_%dB", xmm_payload_size);
+
+		printf("xmm/page median ratio at %dB " STATS_X100_FMT "\n",
+		       xmm_payload_size,
+		       STATS_X100(stats_ratio_x100(xmm_st.median, page_st.median)));
+	}
+
+	hv_teardown_hypercall();
+}
+
+/********************************************/
+/*   reference TSC page read throughput     */
+/********************************************/
+#define REF_BENCH_LEAD_TICKS		100000		/* 10ms */
+#define REF_BENCH_TICKS			10000000	/* 1s */
+
+struct ref_tsc_result {
+	u64 page_reads;
+	u64 msr_reads;
+	u64 retries;
+	u64 invalid;
+} __attribute__((aligned(64)));
+
+static struct ref_tsc_result ref_tsc_results[HV_MAX_CPUS];
+static struct hv_reference_tsc_page *ref_tsc_page;
+static volatile u64 ref_bench_start, ref_bench_end;
+
+static void bench_ref_tsc_page(void)
+{
+	u64 now;
+
+	hv_ref_tsc_read(ref_tsc_page, &now, NULL);
+}
+
+static void bench_ref_count_msr(void)
+{
+	rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+}
+
+/*
+ * All vCPUs spin until the common start time and then read for the
+ * same window, so the sequence retries seen here are the ones caused
+ * by the hypervisor updating the page under concurrent readers.
+ */
+static void ref_tsc_page_reader(void *data)
+{
+	struct ref_tsc_result *r = &ref_tsc_results[smp_id()];
+	u64 now, loops = 0, retries = 0, invalid = 0;
+
+	while (rdmsr(HV_X64_MSR_TIME_REF_COUNT) < ref_bench_start)
+		pause();
+
+	do {
+		if (!hv_ref_tsc_read(ref_tsc_page, &now, &retries)) {
+			invalid++;
+			now = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+		}
+		loops++;
+	} while (now < ref_bench_end);
+
+	r->page_reads = loops;
+	r->retries = retries;
+	r->invalid = invalid;
+}
+
+static void ref_count_msr_reader(void *data)
+{
+	u64 loops = 0;
+
+	while (rdmsr(HV_X64_MSR_TIME_REF_COUNT) < ref_bench_start)
+		pause();
+
+	do
+		loops++;
+	while (rdmsr(HV_X64_MSR_TIME_REF_COUNT) < ref_bench_end);
+
+	ref_tsc_results[smp_id()].msr_reads = loops;
+}
+
+static void ref_bench_window(void (*reader)(void *data), u64 ticks)
+{
+	ref_bench_start = rdmsr(HV_X64_MSR_TIME_REF_COUNT) +
+		REF_BENCH_LEAD_TICKS;
+	ref_bench_end = ref_bench_start + ticks;
+	on_cpus(reader, NULL);
+}
+
+static void ref_tsc_bench(void)
+{
+	struct stats page_st, msr_st;
+	struct ref_tsc_result *r;
+	int cpu, ncpus = MAX(cpu_count(), 1);
+	u64 now;
+
+	ref_tsc_page = alloc_page();
+	if (!ref_tsc_page)
+		report_abort("failed to allocate reference TSC page");
+	wrmsr(HV_X64_MSR_REFERENCE_TSC, (u64)virt_to_phys(ref_tsc_page) | 1);
+
+	if (!hv_ref_tsc_read(ref_tsc_page, &now, NULL)) {
+		report_skip("ref_tsc_bench: reference TSC page not valid");
+		goto out;
+	}
+
+	irq_disable();
+	bench_run(bench_ref_tsc_page);
+	stats_report(bench_samples, BENCH_SAMPLES, &page_st, "ref_tsc_page");
+	bench_run(bench_ref_count_msr);
+	stats_report(bench_samples, BENCH_SAMPLES, &msr_st, "ref_count_msr");
+	irq_enable();
+
+	printf("ref_count_msr/ref_tsc_page median ratio " STATS_X100_FMT "\n",
+	       STATS_X100(stats_ratio_x100(msr_st.median, page_st.median)));
+
+	memset(ref_tsc_results, 0, sizeof(ref_tsc_results));
+	ref_bench_window(ref_tsc_page_reader, REF_BENCH_TICKS);
+	ref_bench_window(ref_count_msr_reader, REF_BENCH_TICKS);
+
+	/* windows are one second long, so loop counts are reads/sec */
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		r = &ref_tsc_results[cpu];
+		printf("cpu %d: ref_tsc_page %" PRIu64 " reads/s, %" PRIu64
+		       " retries, %" PRIu64 " invalid; ref_count_msr %" PRIu64
+		       " reads/s; throughput ratio " STATS_X100_FMT "\n",
+		       cpu, r->page_reads, r->retries, r->invalid, r->msr_reads,
+		       STATS_X100(stats_ratio_x100(r->page_reads, r->msr_reads)));
+	}
+
+out:
+	wrmsr(HV_X64_MSR_REFERENCE_TSC, 0);
+	free_page(ref_tsc_page);
+}
+
+/********************************************/
+/*   reference counter SMP soak             */
+/********************************************/
+#define REF_SOAK_TICKS			100000000	/* 10s */
+#define REF_SOAK_STALL_TICKS		1000		/* 100us */
+#define REF_SOAK_RING			16		/* power of two */
+
+struct ref_soak_sample {
+	u64 tsc;
+	u64 ref;
+};
+
+/* the samples leading up to and including an event, oldest first */
+struct ref_soak_ctx {
+	int n;
+	struct ref_soak_sample s[REF_SOAK_RING];
+};
+
+struct ref_soak_cpu {
+	struct ref_soak_sample ring[REF_SOAK_RING];
+	struct ref_soak_sample first;
+	struct ref_soak_ctx warp_ctx;
+	struct ref_soak_ctx stall_ctx;
+	u64 nr_samples;
+	u64 warps;
+	u64 max_back;
+	u64 max_back_tsc;
+	u64 stalls;
+	u64 max_gap;
+} __attribute__((aligned(64)));
+
+static struct ref_soak_cpu ref_soak_cpus[HV_MAX_CPUS];
+/* largest TIME_REF_COUNT value any vCPU has read so far */
+static atomic64_t ref_soak_last;
+
+static void ref_soak_snapshot(struct ref_soak_cpu *c, struct ref_soak_ctx *ctx)
+{
+	u64 i = c->nr_samples - MIN(c->nr_samples, REF_SOAK_RING);
+
+	for (ctx->n = 0; i < c->nr_samples; i++)
+		ctx->s[ctx->n++] = c->ring[i % REF_SOAK_RING];
+}
+
+/*
+ * The global last value is read before the MSR. Whatever another vCPU
+ * published there was read before our own read started, so finding
+ * our value below it is a real cross-vCPU warp and not a race.
+ */
+static void ref_soak_reader(void *data)
+{
+	struct ref_soak_cpu *c = &ref_soak_cpus[smp_id()];
+	struct ref_soak_sample *s, *prev = NULL;
+	u64 seen, old, tsc, ref;
+
+	while (rdmsr(HV_X64_MSR_TIME_REF_COUNT) < ref_bench_start)
+		pause();
+
+	do {
+		seen = atomic64_read(&ref_soak_last);
+		tsc = rdtsc();
+		ref = rdmsr(HV_X64_MSR_TIME_REF_COUNT);
+
+		s = &c->ring[c->nr_samples++ % REF_SOAK_RING];
+		s->tsc = tsc;
+		s->ref = ref;
+		if (!prev)
+			c->first = *s;
+		else if (ref > prev->ref + REF_SOAK_STALL_TICKS) {
+			c->stalls++;
+			if (ref - prev->ref > c->max_gap) {
+				c->max_gap = ref - prev->ref;
+				ref_soak_snapshot(c, &c->stall_ctx);
+			}
+		}
+		prev = s;
+
+		if (ref < seen) {
+			c->warps++;
+			if (seen - ref > c->max_back) {
+				c->max_back = seen - ref;
+				c->max_back_tsc = tsc;
+				ref_soak_snapshot(c, &c->warp_ctx);
+			}
+			continue;
+		}
+
+		while (ref > seen) {
+			old = atomic64_cmpxchg(&ref_soak_last, seen, ref);
+			if (old == seen)
+				break;
+			seen = old;
+		}
+	} while (ref < ref_bench_end);
+}
+
+/* parts per million of @ref_delta off the TSC-derived expectation */
+static s64 ref_soak_drift_ppm(u64 ref_delta, u64 tsc_delta)
+{
+	u64 expected;
+
+	expected = (unsigned __int128)tsc_delta * TICKS_PER_SEC_RTSC_COUNT /
+		timebase.tsc_hz;
+	if (!expected)
+		return 0;
+	return ((s64)ref_delta - (s64)expected) * 1000000 / (s64)expected;
+}
+
+static void ref_soak_print_ctx(const char *what, struct ref_soak_ctx *ctx)
+{
+	int i;
+
+	if (!ctx->n)
+		return;
+	printf("\tlast %d samples up to the %s:\n", ctx->n, what);
+	for (i = 0; i < ctx->n; i++)
+		printf("\t  tsc %" PRIu64 " ref %" PRIu64 " (%+" PRId64 ")\n",
+		       ctx->s[i].tsc, ctx->s[i].ref,
+		       i ? (s64)(ctx->s[i].ref - ctx->s[i - 1].ref) : (s64)0);
+}
+
+static void ref_count_soak(void)
+{
+	int cpu, ncpus = MAX(cpu_count(), 1), worst = 0;
+	struct ref_soak_sample *last;
+	struct ref_soak_cpu *c;
+	bool sampled = true;
+	u64 warps = 0;
+
+	if (!timebase.tsc_hz)
+		timebase_init();
+
+	memset(ref_soak_cpus, 0, sizeof(ref_soak_cpus));
+	ref_soak_last.counter = 0;
+	ref_bench_window(ref_soak_reader, REF_SOAK_TICKS);
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		c = &ref_soak_cpus[cpu];
+		if (!c->nr_samples) {
+			printf("cpu %d: no samples\n", cpu);
+			sampled = false;
+			continue;
+		}
+		last = &c->ring[(c->nr_samples - 1) % REF_SOAK_RING];
+
+		printf("cpu %d: %lu samples, %lu warps (max back %lu), "
+		       "%lu stalls > %d ticks (max gap %lu)",
+		       cpu, c->nr_samples, c->warps, c->max_back,
+		       c->stalls, REF_SOAK_STALL_TICKS, c->max_gap);
+		if (timebase.tsc_hz)
+			printf(", drift vs TSC %ld ppm",
+			       ref_soak_drift_ppm(last->ref - c->first.ref,
+						  last->tsc - c->first.tsc));
+		printf("\n");
+		ref_soak_print_ctx("largest backward jump", &c->warp_ctx);
+		ref_soak_print_ctx("largest stall", &c->stall_ctx);
+
+		warps += c->warps;
+		if (c->max_back > ref_soak_cpus[worst].max_back)
+			worst = cpu;
+	}
+
+	c = &ref_soak_cpus[worst];
+	if (c->max_back)
+		printf("max backward jump %lu ticks on cpu %d at TSC %lu\n",
+		       c->max_back, worst, c->max_back_tsc);
+	report("every vCPU sampled the reference counter", sampled);
+	report("reference counter is monotonic across vCPUs", warps == 0);
+}
+
+/********************************************/
+/*      sparse VP set encoding benchmark    */
+/********************************************/
+static const int vpset_bench_nr_vps[] = { 8, 64, 240 };
+
+static u32 vpset_vps[HV_VPSET_MAX_VP];
+static int vpset_nr_vps;
+static u64 vpset_buf[2 + HV_VPSET_MAX_BANKS];
+static struct hv_vpset *vpset = (struct hv_vpset *)vpset_buf;
+
+static void bench_vpset_encode(void)
+{
+	hv_vpset_encode(vpset, vpset_vps, vpset_nr_vps);
+}
+
+/* Decode @vpset again and check it holds exactly vpset_vps[] */
+static bool vpset_check(int nr_banks)
 {
+	u64 valid = vpset->valid_bank_mask;
+	int i, bank, n, total = 0;
+
+	if (nr_banks != hv_vpset_nr_banks(vpset))
+		return false;
+
+	for (i = 0; i < vpset_nr_vps; i++) {
+		bank = vpset_vps[i] / 64;
+		if (!(valid & (1ull << bank)))
+			return false;
+		/* position of the bank among the present ones */
+		n = __builtin_popcountll(valid & ((1ull << bank) - 1));
+		if (!(vpset->bank_contents[n] & (1ull << (vpset_vps[i] % 64))))
+			return false;
+	}
+
+	for (i = 0; i < nr_banks; i++)
+		total += __builtin_popcountll(vpset->bank_contents[i]);
+	return total == vpset_nr_vps;
+}
+
+/*
+ * Dense sets number VPs 0..n-1; scattered sets step through the whole
+ * 4K range by 17 (coprime to 4096, so all indexes stay distinct) and
+ * touch as many banks as possible.
+ */
+static void vpset_bench(void)
+{
+	static const char *const layouts[] = { "dense", "scattered" };
+	bool ok = true;
+	int i, j, layout, nr_banks;
+
+	for (i = 0; i < ARRAY_SIZE(vpset_bench_nr_vps); i++) {
+		vpset_nr_vps = vpset_bench_nr_vps[i];
+		for (layout = 0; layout < ARRAY_SIZE(layouts); layout++) {
+			for (j = 0; j < vpset_nr_vps; j++)
+				vpset_vps[j] = layout ? (j * 17) % HV_VPSET_MAX_VP : j;
+
+			nr_banks = hv_vpset_encode(vpset, vpset_vps, vpset_nr_vps);
+			ok &= vpset_check(nr_banks);
+
+			bench_run(bench_vpset_encode);
+			stats_report(bench_samples, BENCH_SAMPLES, NULL,
+				     "vpset_encode_%s_%d banks=%d",
+				     layouts[layout], vpset_nr_vps, nr_banks);
+		}
+	}
+	report("sparse VP set encoding round-trips", ok);
+}
+
+/*
+ * Benchmarks and multi-vCPU checks are not part of the single-vCPU TLFS
+ * conformance run; they are selected by name on the command line, e.g.
+ * "waag_tlfs.flat hcall_bench". These modes bring up the APs.
+ */
+struct bench_mode {
+	const char *name;
+	void (*func)(void);
+};
+
+static struct bench_mode bench_modes[] = {
+	{ "hcall_bench", hcall_bench },
+	{ "xmm_bench", xmm_bench },
+	{ "vpset_bench", vpset_bench },
+	{ "ref_tsc_bench", ref_tsc_bench },
+	{ "ref_count_soak", ref_count_soak },
+	{ "vp_index_map", check_vp_index_map },
+};
+
+static int run_bench_modes(int nwanted, char *wanted[])
+{
+	int i, j;
+
+	setup_vm();
+	setup_idt();
+	smp_init();
+
+	for (i = 0; i < nwanted; i++) {
+		for (j = 0; j < ARRAY_SIZE(bench_modes); j++)
+			if (strcmp(wanted[i], bench_modes[j].name) == 0)
+				break;
+		if (j == ARRAY_SIZE(bench_modes)) {
+			report_skip("unknown benchmark mode %s", wanted[i]);
+			continue;
+		}
+		bench_modes[j].func();
+	}
+	return report_summary();
+}
+
+int main(int ac, char **av)
+{
+	if (ac > 1)
+		return run_bench_modes(ac - 1, av + 1);
+
 	ref_count_msr_init();/*this case need be called firstly*/
 
 	setup_vm();
 	setup_idt();
-	tsc_calibrate();
+	timebase_init();
 
 	check_presence_hv();
 	check_cpuid_range();
@@ -539,5 +1095,5 @@ void main()
 	x64_msr_ref_count();
 	check_rtsc_freq();
 	x64_msr_ref_tsc();
-	report_summary();
+	return report_summary();
 }